@@ -43,6 +43,9 @@
 #include "boot.h"
 #include "mns.h"
 #include "romops.h"
+#ifdef NV_WRITE_BACK
+#include "nv.h"
+#endif
 
 /**
  * @file
@@ -175,6 +178,12 @@ static Processed bootProcessMessage(Message * m) {
         case OPC_BOOT:
             // Set the bootloader flag to be picked up by the bootloader
             writeNVM(BOOT_FLAG_NVM_TYPE, BOOT_FLAG_ADDRESS, 0xFF); 
+#ifdef NV_WRITE_BACK
+            flushNVs();
+#endif
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+            flushEeprom();
+#endif
             RESET();     // will enter the bootloader
             return PROCESSED;
         default:
@@ -110,6 +110,7 @@ const Service canService = {
 // forward declarations
 static SendResult canSendMessage(Message * mp);
 static MessageReceived canReceiveMessage(Message * m);
+static uint8_t canSendSpace(void);
 
 /**
  * The transport descriptor for the CAN service. The application must set
@@ -119,7 +120,8 @@ static MessageReceived canReceiveMessage(Message * m);
  */
 const Transport canTransport = {
     canSendMessage,
-    canReceiveMessage
+    canReceiveMessage,
+    canSendSpace
 };
 
 /**
@@ -475,6 +477,17 @@ static SendResult canSendMessage(Message * mp) {
     return SEND_OK;
 }
 
+/**
+ * Obtain the number of messages which can currently be accepted by 
+ * canSendMessage() without overflowing the transmit buffer. Used to pace 
+ * the sending of timedResponse messages.
+ * @return the number of free transmit buffers
+ */
+static uint8_t canSendSpace(void) {
+    // the queue can hold one less than its size
+    return (uint8_t)(CAN_NUM_TXBUFFERS - 1 - quantity(&txQueue));
+}
+
 /**
  * Check to see if there are any received messages available returning the first
  * one.
@@ -43,6 +43,7 @@
 #include "merglcb.h"
 #include "event_consumer.h"
 #include "event_teach.h"
+#include "ticktime.h"
 /**
  * @file
  * Implementation of the MERGLCB Event Consumer service.
@@ -52,6 +53,27 @@
  * Also handles events with data bytes if HANDLE_DATA_EVENTS is defined. The data is ignored.
  * If COMSUMER_EVS_AS_ACTIONS is defined then EVs after the Happening are treated
  * as Actions and are added to an Action queue to be processed by the application.
+ * 
+ * So that the EVs don't have to be read from NVM and decoded each time an event
+ * is received the Actions of the most recently used events are kept in RAM in 
+ * actionLists. These are discarded whenever the event table is changed. All of
+ * an event's Actions are added to the Action queue at once by pushActions().
+ * 
+ * If ACTION_DELAY is defined then Actions may be delayed. An EV set to 
+ * ACTION_DELAY is followed by an EV giving the number of ACTION_DELAY_UNITs to 
+ * wait before the next Action. Actions which are waiting are held in a hashed
+ * timer wheel of ACTION_WHEEL_SIZE slots, one slot per ACTION_DELAY_UNIT. The
+ * list for each slot is kept in order of the number of turns of the wheel still
+ * to wait, each entry holding the difference from the one before, so each 
+ * ACTION_DELAY_UNIT only the start of one list is looked at however many 
+ * Actions are waiting.
+ * 
+ * If ACTION_QUEUE_LATEST_STATE is defined then the Action queue holds at most 
+ * one Action for each output. Pushing an Action for an output which is already
+ * queued just changes the state of the queued Action, so the length of the 
+ * queue is limited by the number of outputs rather than by how quickly events
+ * arrive. Each Action also has a priority, given by ACTION_PRIORITY(), and is
+ * queued ahead of any Actions with a lower priority.
  */
 
 static DiagnosticVal consumerDiagnostics[NUM_CONSUMER_DIAGNOSTICS];
@@ -59,6 +81,9 @@ static void consumerPowerUp(void);
 static Processed consumerProcessMessage(Message * m);
 static DiagnosticVal * consumerGetDiagnostic(uint8_t index); 
 Boolean pushAction(Action a);
+#ifdef ACTION_DELAY
+static void consumerPoll(void);
+#endif
         
 /**
  * The service descriptor for the eventConsumer service. The application must include this
@@ -72,7 +97,11 @@ const Service eventConsumerService = {
     NULL,               // factoryReset
     consumerPowerUp,               // powerUp
     consumerProcessMessage,               // processMessage
+#ifdef ACTION_DELAY
+    consumerPoll,       // poll
+#else
     NULL,               // poll
+#endif
     NULL,               // highIsr
     NULL,               // lowIsr
     NULL,               // Get ESD data
@@ -80,18 +109,142 @@ const Service eventConsumerService = {
 };
 
 #ifdef COMSUMER_EVS_AS_ACTIONS
+#if (ACTION_QUEUE_SIZE & (ACTION_QUEUE_SIZE-1)) != 0
+#error "ACTION_QUEUE_SIZE must be a power of 2"
+#endif
 static Action actionQueue[ACTION_QUEUE_SIZE];
 static uint8_t areader;
 static uint8_t awriter;
+
+/**
+ * The number of events whose decoded Actions are kept in RAM. May be 
+ * overridden in module.h.
+ */
+#ifndef ACTION_LIST_CACHE_SIZE
+#define ACTION_LIST_CACHE_SIZE  4
+#endif
+#define MAX_EVENT_ACTIONS   ((PARAM_NUM_EV_EVENT-HAPPENING_SIZE)/ACTION_SIZE)
+
+/**
+ * The decoded Actions of an event, excluding any unset EVs.
+ */
+struct ActionList {
+    uint8_t tableIndex;         // NO_INDEX if the entry is free
+    uint8_t numActions;
+    uint8_t lastUsed;           // used to find the least recently used entry
+    uint8_t actions[MAX_EVENT_ACTIONS*ACTION_SIZE];
+#ifdef ACTION_DELAY
+    uint8_t delays[MAX_EVENT_ACTIONS];  // units to wait before each Action
+#endif
+};
+static struct ActionList actionLists[ACTION_LIST_CACHE_SIZE];
+static uint8_t actionListUseCount;
+
+static Boolean pushActions(uint8_t * actions, uint8_t numActions, uint8_t state);
+static struct ActionList * getActionList(uint8_t tableIndex);
+
+#ifdef ACTION_QUEUE_LATEST_STATE
+/**
+ * The priority of an Action, higher values being done first. May be 
+ * overridden in module.h.
+ */
+#ifndef ACTION_PRIORITY
+#define ACTION_PRIORITY(a)  0
+#endif
+static void removeQueuedAction(uint8_t i);
+#endif
+
+#ifdef ACTION_DELAY
+/**
+ * The time represented by each slot of the timer wheel. May be overridden in 
+ * module.h.
+ */
+#ifndef ACTION_DELAY_UNIT
+#define ACTION_DELAY_UNIT   HUNDRED_MILI_SECOND
+#endif
+/**
+ * The number of slots in the timer wheel, must be a power of 2. May be 
+ * overridden in module.h.
+ */
+#ifndef ACTION_WHEEL_SIZE
+#define ACTION_WHEEL_SIZE   32
+#endif
+/**
+ * The number of Actions which can be waiting. May be overridden in module.h.
+ */
+#ifndef NUM_DELAYED_ACTIONS
+#define NUM_DELAYED_ACTIONS 16
+#endif
+#if NUM_DELAYED_ACTIONS > 254
+#error "NUM_DELAYED_ACTIONS must be less than 255"
+#endif
+
+/**
+ * An Action waiting in the timer wheel.
+ */
+typedef struct {
+    uint8_t next;               // next in the slot or free list, NO_INDEX at the end
+    uint16_t nodeNumber;        // the event which scheduled the Action
+    uint16_t eventNumber;
+    uint16_t rounds;            // turns of the wheel to wait after the previous entry
+    Action action;
+} DelayedAction;
+static DelayedAction delayedActions[NUM_DELAYED_ACTIONS];
+static uint8_t wheelHead[ACTION_WHEEL_SIZE];
+static uint8_t wheelPosition;       // the slot done most recently
+static TickValue wheelTime;         // when the wheel was last advanced
+static uint8_t freeDelayedActions;  // head of the list of unused entries
+
+static void scheduleActions(struct ActionList * list, uint16_t nodeNumber, uint16_t eventNumber, uint8_t state);
+static void scheduleAction(uint8_t * action, uint8_t state, uint16_t delay, uint16_t nodeNumber, uint16_t eventNumber);
+static void cancelDelayedActions(uint16_t nodeNumber, uint16_t eventNumber);
+static void wheelInsert(uint8_t slot, uint8_t i, uint16_t rounds);
+static void advanceWheel(void);
+#endif
 #endif
 
 static void consumerPowerUp(void) {
 #ifdef COMSUMER_EVS_AS_ACTIONS
+    uint8_t i;
+    
     areader = 0;
     awriter = 0;
+    for (i=0; i<ACTION_LIST_CACHE_SIZE; i++) {
+        actionLists[i].tableIndex = NO_INDEX;
+    }
+    actionListUseCount = 0;
+    eventTableChanged &= ~EVENT_TABLE_CHANGED_ACTIONS;
+#ifdef ACTION_DELAY
+    for (i=0; i<ACTION_WHEEL_SIZE; i++) {
+        wheelHead[i] = NO_INDEX;
+    }
+    for (i=0; i<NUM_DELAYED_ACTIONS; i++) {
+        delayedActions[i].next = i+1;
+    }
+    delayedActions[NUM_DELAYED_ACTIONS-1].next = NO_INDEX;
+    freeDelayedActions = 0;
+    wheelPosition = 0;
+    wheelTime.val = tickGet();
+#endif
 #endif
 }
 
+#ifdef ACTION_DELAY
+/**
+ * Advance the timer wheel by a slot for each ACTION_DELAY_UNIT which has 
+ * passed, queuing the Actions which are now due.
+ */
+static void consumerPoll(void) {
+    uint8_t i;
+    
+    // limit how much catching up is done at once
+    for (i=0; (i<ACTION_WHEEL_SIZE) && (tickTimeSince(wheelTime) >= ACTION_DELAY_UNIT); i++) {
+        wheelTime.val += ACTION_DELAY_UNIT;
+        advanceWheel();
+    }
+}
+#endif
+
 /**
  * Process consumed events. Process Long and Short events.
  * Also handles events with data bytes if HANDLE_DATA_EVENTS is defined. The data is ignored.
@@ -102,11 +255,15 @@ static void consumerPowerUp(void) {
  * @return PROCESSED if the message needs no further processing
  */
 static Processed consumerProcessMessage(Message *m) {
-    uint8_t start, end;
     uint8_t tableIndex;
-    int8_t change;
-    uint8_t e;
-    Action a;
+#ifdef COMSUMER_EVS_AS_ACTIONS
+    uint8_t state;
+    struct ActionList * list;
+#ifdef ACTION_DELAY
+    uint16_t nodeNumber;
+    uint16_t eventNumber;
+#endif
+#endif
     
     if (m->len < 5) return NOT_PROCESSED;
     
@@ -152,9 +309,7 @@ static Processed consumerProcessMessage(Message *m) {
         case OPC_ASON1:
         case OPC_ASON2:
         case OPC_ASON3:
-            start = HAPPENING_SIZE;
-            end = PARAM_NUM_EV_EVENT;
-            change = ACTION_SIZE;
+            state = TRUE;
             break;
         case OPC_ACOF:
         case OPC_ACOF1:
@@ -164,26 +319,26 @@ static Processed consumerProcessMessage(Message *m) {
         case OPC_ASOF1:
         case OPC_ASOF2:
         case OPC_ASOF3:
-            start = PARAM_NUM_EV_EVENT;
-            end = HAPPENING_SIZE;
-            change = -ACTION_SIZE;
+            state = FALSE;
             break;
         default:
             return NOT_PROCESSED;
     }
-    // get the list of actions and add then to the action queue
-    for (e=start; e<=end; e+=change) {
-        int16_t ev;
-        uint8_t evi;
-        
-        for (evi=0; evi<ACTION_SIZE; evi++) {
-            ev = getEv(tableIndex, e);
-            if (ev < 0) continue;
-            a.a.bytes[evi] = (uint8_t)ev;
-        }
-        a.state = (change>0);
-        pushAction(a);
+    // add all the event's actions to the action queue
+    list = getActionList(tableIndex);
+    if (list == NULL) {
+        return NOT_PROCESSED;
     }
+#ifdef ACTION_DELAY
+    // receiving the event again stops any of its Actions which are still 
+    // waiting. They are found by NN/EN as the event may have moved in the table.
+    nodeNumber = ((uint16_t)m->bytes[0])*256+m->bytes[1];
+    eventNumber = ((uint16_t)m->bytes[2])*256+m->bytes[3];
+    cancelDelayedActions(nodeNumber, eventNumber);
+    scheduleActions(list, nodeNumber, eventNumber, state);
+#else
+    pushActions(list->actions, list->numActions, state);
+#endif
 #else
     APP_processConsumedEvent(tableIndex, m);
 #endif
@@ -206,16 +361,372 @@ static DiagnosticVal * consumerGetDiagnostic(uint8_t index) {
 
 /**
  * Push a message onto the Action queue.
+ * If ACTION_QUEUE_LATEST_STATE is defined and an Action for the same output is
+ * already queued then its state is updated instead. Otherwise the Action is 
+ * put after any Actions of the same or higher priority.
  * @param a the Action
  * @return TRUE for success FALSE for buffer full
  */
 Boolean pushAction(Action a) {
+#ifdef ACTION_QUEUE_LATEST_STATE
+    uint8_t i;
+    uint8_t prev;
+    uint8_t evi;
+    
+    // look for an Action for the same output which is still waiting
+    for (i=areader; i!=awriter; i=(i+1)&(ACTION_QUEUE_SIZE-1)) {
+        for (evi=0; evi<ACTION_SIZE; evi++) {
+            if (actionQueue[i].a.bytes[evi] != a.a.bytes[evi]) break;
+        }
+        if (evi == ACTION_SIZE) {
+            consumerDiagnostics[CONSUMER_DIAG_NUMMERGED].asUint++;
+            if (a.priority <= actionQueue[i].priority) {
+                actionQueue[i].state = a.state;
+                return TRUE;
+            }
+            // it needs to move ahead so take it out and add it again
+            removeQueuedAction(i);
+            break;
+        }
+    }
+#endif
     if (((awriter+1)&(ACTION_QUEUE_SIZE-1)) == areader) return FALSE;	// buffer full
+#ifdef ACTION_QUEUE_LATEST_STATE
+    // make room after the last Action with the same or a higher priority
+    i = awriter;
+    while (i != areader) {
+        prev = (i-1)&(ACTION_QUEUE_SIZE-1);
+        if (actionQueue[prev].priority >= a.priority) break;
+        actionQueue[i] = actionQueue[prev];
+        i = prev;
+    }
+    actionQueue[i] = a;
+    awriter = (awriter+1)&(ACTION_QUEUE_SIZE-1);
+#else
     actionQueue[awriter++] = a;
     if (awriter >= ACTION_QUEUE_SIZE) awriter = 0;
+#endif
     return TRUE;
 }
 
+#ifdef ACTION_QUEUE_LATEST_STATE
+/**
+ * Take an Action out of the Action queue, moving the later Actions up.
+ * @param i the position of the Action in actionQueue
+ */
+static void removeQueuedAction(uint8_t i) {
+    uint8_t next;
+    
+    for (next=(i+1)&(ACTION_QUEUE_SIZE-1); next != awriter; next=(next+1)&(ACTION_QUEUE_SIZE-1)) {
+        actionQueue[i] = actionQueue[next];
+        i = next;
+    }
+    awriter = i;
+}
+#endif
+
+
+#ifdef COMSUMER_EVS_AS_ACTIONS
+/**
+ * Push all of an event's Actions onto the Action queue. For an ON event the 
+ * Actions are queued in EV order and for an OFF event in the reverse order. 
+ * Either all of the Actions are queued or, if there isn't space for them all, 
+ * none of them are. If ACTION_QUEUE_LATEST_STATE is defined then each Action
+ * is pushed using pushAction() instead so that it replaces any Action queued 
+ * for the same output.
+ * 
+ * @param actions the Actions
+ * @param numActions the number of Actions
+ * @param state the state to be given to each Action
+ * @return TRUE for success FALSE for buffer full
+ */
+static Boolean pushActions(uint8_t * actions, uint8_t numActions, uint8_t state) {
+    uint8_t i;
+    uint8_t evi;
+    uint8_t * action;
+#ifdef ACTION_QUEUE_LATEST_STATE
+    Action a;
+    Boolean result;
+    
+    result = TRUE;
+    for (i=0; i<numActions; i++) {
+        if (state) {
+            action = actions + i*ACTION_SIZE;
+        } else {
+            action = actions + (numActions-1-i)*ACTION_SIZE;
+        }
+        a.state = state;
+        for (evi=0; evi<ACTION_SIZE; evi++) {
+            a.a.bytes[evi] = action[evi];
+        }
+        a.priority = ACTION_PRIORITY(a);
+        if ( ! pushAction(a)) {
+            result = FALSE;
+        }
+    }
+    return result;
+#else
+    
+    if (((areader-awriter-1)&(ACTION_QUEUE_SIZE-1)) < numActions) return FALSE;	// not enough space
+    for (i=0; i<numActions; i++) {
+        if (state) {
+            action = actions + i*ACTION_SIZE;
+        } else {
+            action = actions + (numActions-1-i)*ACTION_SIZE;
+        }
+        actionQueue[awriter].state = state;
+        for (evi=0; evi<ACTION_SIZE; evi++) {
+            actionQueue[awriter].a.bytes[evi] = action[evi];
+        }
+        awriter++;
+        if (awriter >= ACTION_QUEUE_SIZE) awriter = 0;
+    }
+    return TRUE;
+#endif
+}
+
+/**
+ * Get the decoded Actions of an event. If they aren't already in RAM the EVs
+ * are read and decoded into the least recently used entry in actionLists.
+ * 
+ * @param tableIndex the index of the event
+ * @return the event's Actions or NULL if the EVs couldn't be read
+ */
+static struct ActionList * getActionList(uint8_t tableIndex) {
+    struct ActionList * list;
+    uint8_t i;
+    uint8_t e;
+    uint8_t evi;
+#ifdef ACTION_DELAY
+    uint8_t delay;
+#endif
+    
+    if (eventTableChanged & EVENT_TABLE_CHANGED_ACTIONS) {
+        // the event table has changed so forget everything
+        for (i=0; i<ACTION_LIST_CACHE_SIZE; i++) {
+            actionLists[i].tableIndex = NO_INDEX;
+        }
+        eventTableChanged &= ~EVENT_TABLE_CHANGED_ACTIONS;
+    }
+    actionListUseCount++;
+    // look for it, remembering a free or the least recently used entry
+    list = actionLists;
+    for (i=0; i<ACTION_LIST_CACHE_SIZE; i++) {
+        if (actionLists[i].tableIndex == tableIndex) {
+            actionLists[i].lastUsed = actionListUseCount;
+            return &(actionLists[i]);
+        }
+        if (list->tableIndex == NO_INDEX) {
+            continue;
+        }
+        if ((actionLists[i].tableIndex == NO_INDEX) ||
+                ((uint8_t)(actionListUseCount - actionLists[i].lastUsed) > (uint8_t)(actionListUseCount - list->lastUsed))) {
+            list = &(actionLists[i]);
+        }
+    }
+    // read all the EVs at once and decode the actions
+    if (getEVs(tableIndex)) {
+        return NULL;
+    }
+    consumerDiagnostics[CONSUMER_DIAG_NUMDECODED].asUint++;
+    list->numActions = 0;
+#ifdef ACTION_DELAY
+    delay = 0;
+#endif
+    for (e=HAPPENING_SIZE; e+ACTION_SIZE<=PARAM_NUM_EV_EVENT; e+=ACTION_SIZE) {
+        if (evs[e] == EV_FILL) continue;
+#ifdef ACTION_DELAY
+        if (evs[e] == ACTION_DELAY) {
+            // the following EV is the delay before the next Action
+            e += ACTION_SIZE;
+            if ((e < PARAM_NUM_EV_EVENT) && (evs[e] != EV_FILL)) {
+                if (delay + evs[e] > 0xFF) {
+                    delay = 0xFF;
+                } else {
+                    delay += evs[e];
+                }
+            }
+            continue;
+        }
+        list->delays[list->numActions] = delay;
+        delay = 0;
+#endif
+        for (evi=0; evi<ACTION_SIZE; evi++) {
+            list->actions[list->numActions*ACTION_SIZE+evi] = evs[e+evi];
+        }
+        list->numActions++;
+    }
+    list->tableIndex = tableIndex;
+    list->lastUsed = actionListUseCount;
+    return list;
+}
+
+#ifdef ACTION_DELAY
+/**
+ * Queue an event's Actions. Those before the first delay are queued straight
+ * away and the rest are put into the timer wheel. For an OFF event the Actions
+ * are done in the reverse order with the same intervals between them.
+ * 
+ * @param list the event's Actions
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @param state the state to be given to each Action
+ */
+static void scheduleActions(struct ActionList * list, uint16_t nodeNumber, uint16_t eventNumber, uint8_t state) {
+    uint8_t first;
+    uint8_t i;
+    uint16_t due;
+    
+    due = 0;
+    if (state) {
+        for (first=0; (first < list->numActions) && (list->delays[first] == 0); first++)
+            ;
+        pushActions(list->actions, first, state);
+        for (i=first; i<list->numActions; i++) {
+            due += list->delays[i];
+            scheduleAction(list->actions+i*ACTION_SIZE, state, due, nodeNumber, eventNumber);
+        }
+    } else {
+        // the Actions after the last delay are the first to be done
+        for (first=list->numActions; (first > 0) && (list->delays[first-1] == 0); first--)
+            ;
+        if (first > 0) {
+            first--;
+        }
+        pushActions(list->actions+first*ACTION_SIZE, list->numActions-first, state);
+        for (i=first; i>0; i--) {
+            due += list->delays[i];
+            scheduleAction(list->actions+(i-1)*ACTION_SIZE, state, due, nodeNumber, eventNumber);
+        }
+    }
+}
+
+/**
+ * Put an Action into the timer wheel.
+ * 
+ * @param action the Action's bytes
+ * @param state the state of the Action
+ * @param delay the number of ACTION_DELAY_UNITs to wait, at least 1
+ * @param nodeNumber the NN of the event which scheduled the Action
+ * @param eventNumber the EN of the event which scheduled the Action
+ */
+static void scheduleAction(uint8_t * action, uint8_t state, uint16_t delay, uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t i;
+    uint8_t evi;
+    
+    i = freeDelayedActions;
+    if (i == NO_INDEX) {
+        consumerDiagnostics[CONSUMER_DIAG_NUMDROPPED].asUint++;
+        return;
+    }
+    freeDelayedActions = delayedActions[i].next;
+    delayedActions[i].nodeNumber = nodeNumber;
+    delayedActions[i].eventNumber = eventNumber;
+    delayedActions[i].action.state = state;
+    for (evi=0; evi<ACTION_SIZE; evi++) {
+        delayedActions[i].action.a.bytes[evi] = action[evi];
+    }
+#ifdef ACTION_QUEUE_LATEST_STATE
+    delayedActions[i].action.priority = ACTION_PRIORITY(delayedActions[i].action);
+#endif
+    wheelInsert((uint8_t)((wheelPosition + delay) & (ACTION_WHEEL_SIZE-1)), i, (delay-1)/ACTION_WHEEL_SIZE);
+}
+
+/**
+ * Remove all the waiting Actions which were scheduled by an event.
+ * 
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ */
+static void cancelDelayedActions(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t slot;
+    uint8_t prev;
+    uint8_t i;
+    uint8_t next;
+    
+    for (slot=0; slot<ACTION_WHEEL_SIZE; slot++) {
+        prev = NO_INDEX;
+        for (i=wheelHead[slot]; i != NO_INDEX; i=next) {
+            next = delayedActions[i].next;
+            if ((delayedActions[i].nodeNumber == nodeNumber) && 
+                    (delayedActions[i].eventNumber == eventNumber)) {
+                // the following entry now waits the removed entry's time too
+                if (next != NO_INDEX) {
+                    delayedActions[next].rounds += delayedActions[i].rounds;
+                }
+                if (prev == NO_INDEX) {
+                    wheelHead[slot] = next;
+                } else {
+                    delayedActions[prev].next = next;
+                }
+                delayedActions[i].next = freeDelayedActions;
+                freeDelayedActions = i;
+            } else {
+                prev = i;
+            }
+        }
+    }
+}
+
+/**
+ * Add an entry to a slot's list after those waiting the same or fewer turns
+ * of the wheel, so that Actions due at the same time are done in the order 
+ * they were scheduled.
+ * 
+ * @param slot the slot of the timer wheel
+ * @param i the entry in delayedActions
+ * @param rounds the number of turns of the wheel to wait
+ */
+static void wheelInsert(uint8_t slot, uint8_t i, uint16_t rounds) {
+    uint8_t prev;
+    uint8_t next;
+    
+    prev = NO_INDEX;
+    for (next=wheelHead[slot]; 
+            (next != NO_INDEX) && (delayedActions[next].rounds <= rounds); 
+            next=delayedActions[next].next) {
+        rounds -= delayedActions[next].rounds;
+        prev = next;
+    }
+    delayedActions[i].rounds = rounds;
+    delayedActions[i].next = next;
+    if (next != NO_INDEX) {
+        delayedActions[next].rounds -= rounds;
+    }
+    if (prev == NO_INDEX) {
+        wheelHead[slot] = i;
+    } else {
+        delayedActions[prev].next = i;
+    }
+}
+
+/**
+ * Move the timer wheel on to the next slot and queue its Actions which are 
+ * due. If the Action queue is full an Action is tried again in the next slot.
+ */
+static void advanceWheel(void) {
+    uint8_t slot;
+    uint8_t i;
+    
+    wheelPosition = (wheelPosition+1) & (ACTION_WHEEL_SIZE-1);
+    slot = wheelPosition;
+    // the Actions which are due are at the start of the list
+    while (((i = wheelHead[slot]) != NO_INDEX) && (delayedActions[i].rounds == 0)) {
+        wheelHead[slot] = delayedActions[i].next;
+        if (pushAction(delayedActions[i].action)) {
+            delayedActions[i].next = freeDelayedActions;
+            freeDelayedActions = i;
+        } else {
+            wheelInsert((slot+1) & (ACTION_WHEEL_SIZE-1), i, 0);
+        }
+    }
+    if (i != NO_INDEX) {
+        // the rest of the list is now a turn nearer
+        delayedActions[i].rounds--;
+    }
+}
+#endif
+#endif
 
 /**
  * Pull the next Action from the queue.
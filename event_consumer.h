@@ -71,15 +71,45 @@
  * - #define COMSUMER_EVS_AS_ACTIONS Define if the EVs are to be treated to be Actions
  * - #define ACTION_SIZE           The number of bytes used to hold an Action. 
  *                               Currently must be 1.
- * - #define ACTION_QUEUE_SIZE     The size of the Action queue.
+ * - #define ACTION_QUEUE_SIZE     The size of the Action queue. Must be a power
+ *                               of 2.
+ * - #define ACTION_LIST_CACHE_SIZE Optional. The number of events whose decoded
+ *                               Actions are kept in RAM. Each needs 
+ *                               PARAM_NUM_EV_EVENT+2 bytes. Defaults to 4.
+ * - #define ACTION_DELAY          Optional. An Action value which isn't itself
+ *                               an Action but means that the following EV is
+ *                               the number of ACTION_DELAY_UNITs to wait 
+ *                               before doing the next Action. The Actions of
+ *                               an OFF event are done in the reverse order 
+ *                               with the same intervals. Receiving the event
+ *                               again cancels any of its Actions still waiting.
+ * - #define ACTION_DELAY_UNIT     Optional. The unit of delay in ticks. Defaults
+ *                               to HUNDRED_MILI_SECOND.
+ * - #define ACTION_WHEEL_SIZE     Optional. The number of slots in the timer 
+ *                               wheel holding waiting Actions. Must be a power
+ *                               of 2. Defaults to 32.
+ * - #define NUM_DELAYED_ACTIONS   Optional. The number of Actions which can be
+ *                               waiting at once. Defaults to 16.
+ * - #define ACTION_QUEUE_LATEST_STATE Optional. If defined the Action queue holds
+ *                               at most one Action for each output, a new 
+ *                               Action for an output already queued just
+ *                               changing the state of the queued Action. 
+ *                               Actions are queued in priority order.
+ * - #define ACTION_PRIORITY(a)    Optional. Gives the priority of Action a, for 
+ *                               example so that safety Actions are done first.
+ *                               Higher values are done first. Only used with 
+ *                               ACTION_QUEUE_LATEST_STATE. Defaults to 0.
  * 
  */ 
 
 
 extern const Service eventConsumerService;
 
-#define NUM_CONSUMER_DIAGNOSTICS    1   ///< Number of diagnostics
+#define NUM_CONSUMER_DIAGNOSTICS    4   ///< Number of diagnostics
 #define CONSUMER_DIAG_NUMCONSUMED   0   ///< Number of events consumed
+#define CONSUMER_DIAG_NUMDECODED    1   ///< Number of times an event's EVs were read and decoded into Actions
+#define CONSUMER_DIAG_NUMDROPPED    2   ///< Number of delayed Actions dropped as too many were already waiting
+#define CONSUMER_DIAG_NUMMERGED     3   ///< Number of Actions which replaced a queued Action for the same output
 
 typedef struct {
     uint8_t state;
@@ -92,6 +122,9 @@ typedef struct {
 #endif
         uint8_t bytes[ACTION_SIZE];
     } a;
+#ifdef ACTION_QUEUE_LATEST_STATE
+    uint8_t priority;   // higher priority Actions are done first
+#endif
 } Action;
 
 extern Action * popAction(void);
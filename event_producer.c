@@ -44,12 +44,26 @@
  * Implementation of the MERGLCB Event Produer service.
  * @details
  * Handle the production of events.
- * If EVENT_HASH_TABLE is defined then an additional lookup table 
- * uint8_t action2Event[NUM_HAPPENINGS] is used to obtain an Event 
- * using a Happening stored in the first EVs. This table is also populated using 
- * rebuildHashTable(). Given a Happening this table can be used to obtain the 
- * index into the EventTable for the Happening so the Event at that index in the 
- * EventTable can be transmitted.
+ * If EVENT_HASH_TABLE is defined then an additional lookup table is used to 
+ * obtain the Events using a Happening stored in the first EVs. The indexes into
+ * the EventTable of the events for Happening h are held in 
+ * happeningEvents[happeningEventStart[h]] up to happeningEvents[happeningEventStart[h+1]-1]
+ * so a Happening may produce any number of events. This table is also populated
+ * using rebuildHashTable() and kept up to date as events are taught. Given a 
+ * Happening this table can be used to obtain the indexes into the EventTable 
+ * so the Events at those indexes in the EventTable can be transmitted.
+ * 
+ * A start of day (SOD) is started by startSOD() or, for a single Happening, 
+ * startSODHappening(). The state of each produced event is obtained from 
+ * APP_GetEventState() and sent as an ARON/AROF, or ARSON/ARSOF for short 
+ * events, using a timedResponse so that the responses are paced by the space
+ * in the transmit buffers rather than flooding them.
+ * 
+ * If PRODUCED_EVENT_CACHE_SIZE is defined then the NN and EN, ready to be sent,
+ * of the event found by sendProducedEvent() for a Happening are kept in RAM in 
+ * producedCache so that next time the Happening is sent the event table 
+ * doesn't need to be read. The cache is cleared whenever the event table or 
+ * the module's NN change.
  */
 
 #include <xc.h>
@@ -58,10 +72,77 @@
 #include "event_teach.h"
 #include "event_producer.h"
 #include "mns.h"
+#include "timedResponse.h"
+#include "ticktime.h"
+#ifdef PRODUCER_INTERVAL_NV
+#include "nv.h"
+#endif
+
+#if !defined(EVENT_HASH_TABLE) && (EVENT_TABLE_WIDTH < HAPPENING_SIZE)
+#error "The Happening must fit within the first row of the event table"
+#endif
+
+#ifdef PRODUCER_INTERVAL_NV
+#if (PRODUCER_INTERVAL_NV + MAX_HAPPENING) > NV_NUM
+#error "PRODUCER_INTERVAL_NV needs an NV for each Happening"
+#endif
+#if defined(PRODUCER_DEBOUNCE_NV) && ((PRODUCER_DEBOUNCE_NV + MAX_HAPPENING) > NV_NUM)
+#error "PRODUCER_DEBOUNCE_NV needs an NV for each Happening"
+#endif
+/**
+ * The unit of the interval and debounce NVs. May be overridden in module.h.
+ */
+#ifndef PRODUCER_INTERVAL_UNIT
+#define PRODUCER_INTERVAL_UNIT  TEN_MILI_SECOND
+#endif
+#endif
+
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+/**
+ * The number of transmit buffers to be left free for other messages. Answers 
+ * to AREQ/ASRQ are queued once the transport has no more than this number of
+ * free buffers. May be overridden in module.h.
+ */
+#ifndef PRODUCER_TX_RESERVE
+#define PRODUCER_TX_RESERVE     0
+#endif
+#endif
+
+#if defined(PRODUCED_EVENT_CACHE_SIZE) || defined(PRODUCER_INTERVAL_NV) || defined(PRODUCER_STATE_CACHE) || defined(PRODUCER_AREQ_QUEUE_SIZE)
+#define PRODUCER_POWER_UP
+#endif
+#if defined(PRODUCER_INTERVAL_NV) || defined(PRODUCER_AREQ_QUEUE_SIZE)
+#define PRODUCER_POLL
+#endif
 
 // Forward function declarations
 static Processed producerProcessMessage(Message *m);
+#ifdef PRODUCER_POWER_UP
+static void producerPowerUp(void);
+#endif
+#ifdef PRODUCER_POLL
+static void producerPoll(void);
+#endif
+#ifdef PRODUCED_EVENT_CACHE_SIZE
+static void clearProducedCache(void);
+#endif
+#ifdef PRODUCER_INTERVAL_NV
+static void pollHeldEvents(void);
+static Boolean holdProducedEvent(uint16_t happeningIndex, EventState onOff);
+#endif
+#ifdef PRODUCER_STATE_CACHE
+static void setHappeningState(uint16_t happeningIndex, EventState onOff);
+#endif
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+static Boolean canAnswer(void);
+#endif
+static EventState getHappeningState(Happening happening);
+static Boolean getEventHappening(uint8_t tableIndex, Happening * happening);
+static void answerStatusRequest(Boolean shortEvent, uint8_t * bytes, Happening happening);
+static Boolean sendProducedFrame(Happening happening, EventState onOff);
 static DiagnosticVal * producerGetDiagnostic(uint8_t index);
+static void transmit(Message * m);
+TimedResponseResult sodCallback(uint8_t type, uint8_t serviceIndex, uint8_t step);
 
 /**
  * The service descriptor for the event producer service. The application must include this
@@ -73,9 +154,17 @@ const Service eventProducerService = {
     SERVICE_ID_PRODUCER,// id
     1,                  // version
     NULL,               // factoryReset
+#ifdef PRODUCER_POWER_UP
+    producerPowerUp,    // powerUp
+#else
     NULL,               // powerUp
+#endif
     producerProcessMessage,  // processMessage
+#ifdef PRODUCER_POLL
+    producerPoll,       // poll
+#else
     NULL,               // poll
+#endif
     NULL,               // highIsr
     NULL,               // lowIsr
     NULL,               // Get ESD data
@@ -84,10 +173,147 @@ const Service eventProducerService = {
 
 static DiagnosticVal producerDiagnostics[NUM_PRODUCER_DIAGNOSTICS];
 
+static Boolean sodAll;              // responding for all Happenings
+static Happening sodHappening;      // otherwise the Happening responded for
+static TickValue sodStartTime;
+
+#ifdef PRODUCER_INTERVAL_NV
+/*
+ * The rate limiting state of each Happening. happeningTimer counts down the
+ * interval, or debounce time, in PRODUCER_INTERVAL_UNITs and is 0 when the
+ * Happening is free to send.
+ */
+static uint8_t happeningTimer[MAX_HAPPENING+1];
+static uint8_t happeningFlags[MAX_HAPPENING+1];
+#define HELD_SENT_ON        0x01    // the last state sent was ON
+#define HELD_WANTED_ON      0x02    // the latest state requested is ON
+#define HELD_PENDING        0x04    // the requested state is waiting to be sent
+#define HELD_DEBOUNCING     0x08    // the timer is the debounce time
+#define HELD_SENT_VALID     0x10    // a state has been sent
+static TickValue producerTickTime;
+#endif
+
+#ifdef PRODUCER_STATE_CACHE
+/*
+ * The last state of each Happening passed to sendProducedEvent() or 
+ * sendProducedEvents(), one bit per Happening.
+ */
+static uint8_t happeningStateKnown[(MAX_HAPPENING+8)/8];
+static uint8_t happeningStateOn[(MAX_HAPPENING+8)/8];
+#endif
+
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+/**
+ * An AREQ or ASRQ which is waiting for space to send the answer.
+ */
+typedef struct {
+    Boolean shortEvent;     // answer with ARSON/ARSOF rather than ARON/AROF
+    uint8_t bytes[4];       // the NN and EN of the request
+    Happening happening;
+} StatusRequest;
+static StatusRequest statusRequests[PRODUCER_AREQ_QUEUE_SIZE];
+static uint8_t statusRequestHead;   // the oldest request
+static uint8_t statusRequestCount;
+#endif
+
+/**
+ * The bytes of a produced event as they are sent.
+ */
+typedef struct {
+    uint16_t happening;     // the Happening, 0xFFFF if the entry is unused
+    uint8_t type;           // PRODUCED_FRAME_NONE, _LONG or _SHORT
+    uint8_t bytes[4];       // the NN and EN
+} ProducedFrame;
+#define PRODUCED_FRAME_NONE     0   // the Happening has no produced event
+#define PRODUCED_FRAME_LONG     1
+#define PRODUCED_FRAME_SHORT    2
+
+static uint8_t produceEvents(Happening happening, EventState onOff, uint8_t maxEvents, ProducedFrame * frame);
+
+#ifdef PRODUCED_EVENT_CACHE_SIZE
+static ProducedFrame producedCache[PRODUCED_EVENT_CACHE_SIZE];
+static uint16_t producedCacheNN;        // the module's NN when the cache was cleared
+#endif
+
+#ifdef PRODUCER_POWER_UP
+/**
+ * Power up clears the cache of produced events, the rate limiting state, the
+ * cache of Happening states and the queue of status requests.
+ */
+static void producerPowerUp(void) {
+#if defined(PRODUCER_INTERVAL_NV) || defined(PRODUCER_STATE_CACHE)
+    uint16_t i;
+#endif
+    
+#ifdef PRODUCER_INTERVAL_NV
+    for (i=0; i<=MAX_HAPPENING; i++) {
+        happeningTimer[i] = 0;
+        happeningFlags[i] = 0;
+    }
+    producerTickTime.val = tickGet();
+#endif
+#ifdef PRODUCER_STATE_CACHE
+    for (i=0; i<sizeof(happeningStateKnown); i++) {
+        happeningStateKnown[i] = 0;
+    }
+#endif
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+    statusRequestHead = 0;
+    statusRequestCount = 0;
+#endif
+#ifdef PRODUCED_EVENT_CACHE_SIZE
+    clearProducedCache();
+#endif
+}
+#endif
+
+#ifdef PRODUCER_POLL
+/**
+ * Send any held events and answer any queued status requests.
+ */
+static void producerPoll(void) {
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+    StatusRequest * r;
+    
+    while ((statusRequestCount != 0) && canAnswer()) {
+        r = &(statusRequests[statusRequestHead]);
+        answerStatusRequest(r->shortEvent, r->bytes, r->happening);
+        statusRequestHead++;
+        if (statusRequestHead >= PRODUCER_AREQ_QUEUE_SIZE) {
+            statusRequestHead = 0;
+        }
+        statusRequestCount--;
+    }
+#endif
+#ifdef PRODUCER_INTERVAL_NV
+    pollHeldEvents();
+#endif
+}
+#endif
+
+#ifdef PRODUCED_EVENT_CACHE_SIZE
+
+/**
+ * Empty the cache of produced events.
+ */
+static void clearProducedCache(void) {
+    uint8_t i;
+    
+    for (i=0; i<PRODUCED_EVENT_CACHE_SIZE; i++) {
+        producedCache[i].happening = 0xFFFF;
+    }
+    eventTableChanged &= ~EVENT_TABLE_CHANGED_PRODUCED;
+    producedCacheNN = nn.word;
+}
+#endif
+
 static Processed producerProcessMessage(Message *m) {
     uint8_t index;
     Happening h;
-    int16_t ev;
+    Boolean shortEvent;
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+    StatusRequest * r;
+#endif
     
     switch (m->opc) {
         case OPC_AREQ:
@@ -96,43 +322,171 @@ static Processed producerProcessMessage(Message *m) {
                 sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, CMDERR_INV_CMD);
                 return PROCESSED;
             }
-            if (m->opc == OPC_AREQ) {
-                index = findEvent((m->bytes[0]<<8)&(m->bytes[1]), (m->bytes[2]<<8)&(m->bytes[3]));
+            shortEvent = (m->opc == OPC_ASRQ);
+            if (shortEvent) {
+                index = findEvent(0, ((uint16_t)(m->bytes[2])<<8)|(m->bytes[3]));
             } else {
-                index = findEvent(0, (m->bytes[2]<<8)&(m->bytes[3]));
+                index = findEvent(((uint16_t)(m->bytes[0])<<8)|(m->bytes[1]), ((uint16_t)(m->bytes[2])<<8)|(m->bytes[3]));
             }
             if (index == NO_INDEX) return PROCESSED;
-            // now get the happening
-            ev = getEv(index, 0);
-            if (ev < 0) return PROCESSED;
-#if HAPPENING_SIZE == 1
-            h = (uint8_t)ev;
-#endif
-#if HAPPENING_SIZE == 2
-            h.bytes.hi = (uint8_t)ev;
-            ev = getEv(index, 1);
-            if (ev < 0) return PROCESSED;
-            h.bytes.lo = (uint8_t)ev;
-#endif
-            if (m->opc == OPC_AREQ) {
-                if (APP_GetEventState(h) == EVENT_ON) {
-                    sendMessage4(OPC_ARON, m->bytes[0], m->bytes[1], m->bytes[2], m->bytes[3]);
-                } else {
-                    sendMessage4(OPC_AROF, m->bytes[0], m->bytes[1], m->bytes[2], m->bytes[3]);
+            if ( ! getEventHappening(index, &h)) return PROCESSED;
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+            if ((statusRequestCount != 0) || ! canAnswer()) {
+                // keep the answers in order and wait for space to send them
+                if (statusRequestCount >= PRODUCER_AREQ_QUEUE_SIZE) {
+                    // full, and there's no room to send, so drop this request
+                    producerDiagnostics[PRODUCER_DIAG_AREQ_DROPPED].asUint++;
+                    return PROCESSED;
                 }
-            } else {
-                if (APP_GetEventState(h) == EVENT_ON) {
-                    sendMessage4(OPC_ARSON, nn.bytes.hi, nn.bytes.lo, m->bytes[2], m->bytes[3]);
-                } else {
-                    sendMessage4(OPC_ARSOF, nn.bytes.hi, nn.bytes.lo, m->bytes[2], m->bytes[3]);
+                index = statusRequestHead + statusRequestCount;
+                if (index >= PRODUCER_AREQ_QUEUE_SIZE) {
+                    index -= PRODUCER_AREQ_QUEUE_SIZE;
                 }
+                r = &(statusRequests[index]);
+                r->shortEvent = shortEvent;
+                r->bytes[0] = m->bytes[0];
+                r->bytes[1] = m->bytes[1];
+                r->bytes[2] = m->bytes[2];
+                r->bytes[3] = m->bytes[3];
+                r->happening = h;
+                statusRequestCount++;
+                return PROCESSED;
             }
+#endif
+            answerStatusRequest(shortEvent, m->bytes, h);
             return PROCESSED;
         default:
             break;
     }
     return NOT_PROCESSED;
 }
+
+/**
+ * Get the Happening of an event from the first EVs.
+ * 
+ * @param tableIndex the index of the event in the event table
+ * @param happening where the Happening is returned
+ * @return TRUE if the event has a Happening
+ */
+static Boolean getEventHappening(uint8_t tableIndex, Happening * happening) {
+#if EVENT_TABLE_WIDTH >= HAPPENING_SIZE
+    EventTable row;
+    
+    // the Happening is in the first row so only one read is needed
+    readEventRow(tableIndex, &row);
+    if (( ! row.flags.continued) && (row.flags.eVsUsed < HAPPENING_SIZE)) return FALSE;
+#if HAPPENING_SIZE == 2
+    happening->bytes.hi = row.evs[0];
+    happening->bytes.lo = row.evs[1];
+#else
+    *happening = row.evs[0];
+#endif
+#else
+    int16_t ev;
+    
+    ev = getEv(tableIndex, 0);
+    if (ev < 0) return FALSE;
+    happening->bytes.hi = (uint8_t)ev;
+    ev = getEv(tableIndex, 1);
+    if (ev < 0) return FALSE;
+    happening->bytes.lo = (uint8_t)ev;
+#endif
+    return TRUE;
+}
+
+/**
+ * Get the state of a Happening. If PRODUCER_STATE_CACHE is defined the state
+ * last sent by the application is used and the application is only asked for
+ * states which it hasn't yet sent.
+ * 
+ * @param happening the Happening
+ * @return the EventState of the Happening
+ */
+static EventState getHappeningState(Happening happening) {
+#ifdef PRODUCER_STATE_CACHE
+    uint16_t happeningIndex;
+    EventState state;
+    
+#if HAPPENING_SIZE == 2
+    happeningIndex = happening.word;
+#else
+    happeningIndex = happening;
+#endif
+    if (happeningIndex <= MAX_HAPPENING) {
+        if (happeningStateKnown[happeningIndex>>3] & (1<<(happeningIndex&7))) {
+            if (happeningStateOn[happeningIndex>>3] & (1<<(happeningIndex&7))) {
+                return EVENT_ON;
+            }
+            return EVENT_OFF;
+        }
+        state = APP_GetEventState(happening);
+        setHappeningState(happeningIndex, state);
+        return state;
+    }
+#endif
+    return APP_GetEventState(happening);
+}
+
+#ifdef PRODUCER_STATE_CACHE
+/**
+ * Record the state of a Happening.
+ * 
+ * @param happeningIndex the Happening
+ * @param onOff the EventState
+ */
+static void setHappeningState(uint16_t happeningIndex, EventState onOff) {
+    if (happeningIndex > MAX_HAPPENING) return;
+    happeningStateKnown[happeningIndex>>3] |= (uint8_t)(1<<(happeningIndex&7));
+    if (onOff == EVENT_ON) {
+        happeningStateOn[happeningIndex>>3] |= (uint8_t)(1<<(happeningIndex&7));
+    } else {
+        happeningStateOn[happeningIndex>>3] &= (uint8_t)~(1<<(happeningIndex&7));
+    }
+}
+#endif
+
+#ifdef PRODUCER_AREQ_QUEUE_SIZE
+/**
+ * Check whether the transport has space to send an answer to a status request.
+ * 
+ * @return TRUE if the answer can be sent now
+ */
+static Boolean canAnswer(void) {
+    if ((transport == NULL) || (transport->sendSpace == NULL)) {
+        // transport can't tell us so just send
+        return TRUE;
+    }
+    return (transport->sendSpace() > PRODUCER_TX_RESERVE);
+}
+#endif
+
+/**
+ * Send the answer to an AREQ or ASRQ with the current state of the Happening.
+ * 
+ * @param shortEvent TRUE to answer with ARSON/ARSOF and our own NN, FALSE for ARON/AROF
+ * @param bytes the NN and EN of the request
+ * @param happening the Happening of the requested event
+ */
+static void answerStatusRequest(Boolean shortEvent, uint8_t * bytes, Happening happening) {
+    Message m;
+    
+    if (getHappeningState(happening) == EVENT_ON) {
+        m.opc = shortEvent ? OPC_ARSON : OPC_ARON;
+    } else {
+        m.opc = shortEvent ? OPC_ARSOF : OPC_AROF;
+    }
+    m.len = 5;
+    if (shortEvent) {
+        m.bytes[0] = nn.bytes.hi;
+        m.bytes[1] = nn.bytes.lo;
+    } else {
+        m.bytes[0] = bytes[0];
+        m.bytes[1] = bytes[1];
+    }
+    m.bytes[2] = bytes[2];
+    m.bytes[3] = bytes[3];
+    transmit(&m);
+}
 /**
  * Provide the means to return the diagnostic data.
  * @param index the diagnostic index
@@ -146,75 +500,436 @@ static DiagnosticVal * producerGetDiagnostic(uint8_t index) {
 }
 
 /**
- * Get the Produced Event to transmit for the specified action.
- * If the same produced action has been provisioned for more than 1 event
- * only the first provisioned event will be returned.
+ * Send the events produced by a Happening. The message is built in place and
+ * passed straight to the transport rather than being copied by sendMessage4()
+ * so that for each event only the opcode, NN and EN need to be filled in.
  * The Happening is assumed to be in the first one or two EVs depending upon the
  * HAPPENING_SIZE defined in module.h.
  * 
- * @param happening used to lookup the event to be sent
- * @param onOff TRUE for an ON event, FALSE for an OFF event
- * @return TRUE if the produced event is found
+ * @param happening used to lookup the events to be sent
+ * @param onOff EVENT_ON for ON events, EVENT_OFF for OFF events
+ * @param maxEvents the maximum number of events to send
+ * @param frame if not NULL the first event sent is saved here
+ * @return the number of events sent
  */
-Boolean sendProducedEvent(Happening happening, EventState onOff) {
+static uint8_t produceEvents(Happening happening, EventState onOff, uint8_t maxEvents, ProducedFrame * frame) {
+    Message m;
     Word producedEventNN;
-    Word producedEventEN;
-    uint8_t opc;
-#ifndef EVENT_HASH_TABLE
+    uint8_t numSent;
+#ifdef EVENT_HASH_TABLE
+    uint16_t happeningIndex;
+    uint8_t i;
+    Event event;
+#else
     uint8_t tableIndex;
+    EventTable row;
 #endif
 
+    numSent = 0;
+    m.len = 5;
+    if (frame != NULL) {
+        frame->type = PRODUCED_FRAME_NONE;
+    }
 #ifdef EVENT_HASH_TABLE
-    if (happening2Event[happening] == NO_INDEX) return FALSE;
-    producedEventNN.word = getNN(happening2Event[happening]);
-    producedEventEN.word = getEN(happening2Event[happening]);
+#if HAPPENING_SIZE == 2
+    happeningIndex = happening.word;
+#else
+    happeningIndex = happening;
+#endif
+    if (happeningIndex > MAX_HAPPENING) return 0;
+    // the Happening index lists all the events for the Happening
+    for (i = happeningEventStart[happeningIndex]; 
+            (i < happeningEventStart[happeningIndex+1]) && (numSent < maxEvents); 
+            i++) {
+        getEvent(happeningEvents[i], &event);
+        producedEventNN.word = event.NN;
+        m.bytes[2] = (uint8_t)(event.EN >> 8);
+        m.bytes[3] = (uint8_t)(event.EN);
 #else
-    for (tableIndex=0; tableIndex < NUM_EVENTS; tableIndex++) {
-        if (validStart(tableIndex)) {
-            Happening h;
-            int16_t ev; 
+    for (tableIndex = nextValidStart(0); 
+            (tableIndex < NUM_EVENTS) && (numSent < maxEvents); 
+            tableIndex = nextValidStart(tableIndex+1)) {
+        // decode the whole row with one read rather than using getEv()
+        readEventRow(tableIndex, &row);
+        if (( ! row.flags.continued) && (row.flags.eVsUsed < HAPPENING_SIZE)) continue;
 #if HAPPENING_SIZE == 2
-            ev = getEv(tableIndex, 0);
-            if (ev < 0) continue;
-            h.bytes.hi = (uint8_t) ev;
-            ev = getEv(tableIndex, 1);
-            if (ev < 0) continue;
-            h.bytes.lo = (uint8_t) ev;
-            if (h.word == happening.word) {
-#endif
-#if HAPPENING_SIZE ==1
-            ev = getEv(tableIndex, 0);
-            if (ev < 0) continue;
-            h = (uint8_t) ev;
-            if (h == happening) {
-#endif
-                producedEventNN.word = getNN(tableIndex);
-                producedEventEN.word = getEN(tableIndex);
-#endif
-                if (producedEventNN.word == 0) {
-                    // Short event
-                    if (onOff == EVENT_ON) {
-                        opc = OPC_ASON;
-                    } else {
-                        opc = OPC_ASOF;
-                    }
-                    producedEventNN.word = nn.word;
-                } else {
-                    // Long event
-                    if (onOff == EVENT_ON) {
-                        opc = OPC_ACON;
-                    } else {
-                        opc = OPC_ACOF;
-                    }
-                }
-                sendMessage4(opc, producedEventNN.bytes.hi, producedEventNN.bytes.lo, producedEventEN.bytes.hi, producedEventEN.bytes.lo);
-                producerDiagnostics[PRODUCER_DIAG_NUMPRODUCED].asUint++;
-                return TRUE;
-#ifndef EVENT_HASH_TABLE
+        if ((row.evs[0] != happening.bytes.hi) || (row.evs[1] != happening.bytes.lo)) continue;
+#endif
+#if HAPPENING_SIZE == 1
+        if (row.evs[0] != happening) continue;
+#endif
+        if (row.flags.forceOwnNN) {
+            producedEventNN.word = nn.word;
+        } else {
+            producedEventNN.word = row.event.NN;
+        }
+        m.bytes[2] = (uint8_t)(row.event.EN >> 8);
+        m.bytes[3] = (uint8_t)(row.event.EN);
+#endif
+        if (producedEventNN.word == 0) {
+            // Short event
+            if (onOff == EVENT_ON) {
+                m.opc = OPC_ASON;
+            } else {
+                m.opc = OPC_ASOF;
+            }
+            producedEventNN.word = nn.word;
+        } else {
+            // Long event
+            if (onOff == EVENT_ON) {
+                m.opc = OPC_ACON;
+            } else {
+                m.opc = OPC_ACOF;
             }
         }
+        m.bytes[0] = producedEventNN.bytes.hi;
+        m.bytes[1] = producedEventNN.bytes.lo;
+        if ((frame != NULL) && (numSent == 0)) {
+            if ((m.opc == OPC_ASON) || (m.opc == OPC_ASOF)) {
+                frame->type = PRODUCED_FRAME_SHORT;
+            } else {
+                frame->type = PRODUCED_FRAME_LONG;
+            }
+            frame->bytes[0] = m.bytes[0];
+            frame->bytes[1] = m.bytes[1];
+            frame->bytes[2] = m.bytes[2];
+            frame->bytes[3] = m.bytes[3];
+        }
+        transmit(&m);
+        numSent++;
+        producerDiagnostics[PRODUCER_DIAG_NUMPRODUCED].asUint++;
     }
+    return numSent;
+}
+
+/**
+ * Pass a message straight to the transport.
+ * 
+ * @param m the message
+ */
+static void transmit(Message * m) {
+    if ((transport != NULL) && (transport->sendMessage != NULL)) {
+        transport->sendMessage(m);
+    }
+}
+
+/**
+ * Send the Produced Event for the specified Happening.
+ * If the same Happening has been provisioned for more than 1 event
+ * only the first event in the event table will be sent. Use 
+ * sendProducedEvents() to send all of them.
+ * If PRODUCER_INTERVAL_NV is defined the event may be held back and sent 
+ * later by the rate limiting.
+ * 
+ * @param happening used to lookup the event to be sent
+ * @param onOff TRUE for an ON event, FALSE for an OFF event
+ * @return TRUE if the produced event is found or is held back
+ */
+Boolean sendProducedEvent(Happening happening, EventState onOff) {
+#ifdef PRODUCER_STATE_CACHE
+#if HAPPENING_SIZE == 2
+    setHappeningState(happening.word, onOff);
+#else
+    setHappeningState(happening, onOff);
+#endif
+#endif
+#ifdef PRODUCER_INTERVAL_NV
+#if HAPPENING_SIZE == 2
+    if (holdProducedEvent(happening.word, onOff)) return TRUE;
+#else
+    if (holdProducedEvent(happening, onOff)) return TRUE;
+#endif
+#endif
+    return sendProducedFrame(happening, onOff);
+}
+
+/**
+ * Send the first Produced Event for the specified Happening, using the 
+ * producedCache if PRODUCED_EVENT_CACHE_SIZE is defined.
+ * 
+ * @param happening used to lookup the event to be sent
+ * @param onOff EVENT_ON for an ON event, EVENT_OFF for an OFF event
+ * @return TRUE if the produced event is found
+ */
+static Boolean sendProducedFrame(Happening happening, EventState onOff) {
+#ifdef PRODUCED_EVENT_CACHE_SIZE
+    uint16_t happeningIndex;
+    ProducedFrame * frame;
+    Message m;
+    
+    if ((eventTableChanged & EVENT_TABLE_CHANGED_PRODUCED) || (producedCacheNN != nn.word)) {
+        // events may have changed so forget everything
+        clearProducedCache();
+    }
+#if HAPPENING_SIZE == 2
+    happeningIndex = happening.word;
+#else
+    happeningIndex = happening;
 #endif
+    frame = &(producedCache[happeningIndex % PRODUCED_EVENT_CACHE_SIZE]);
+    if (frame->happening == happeningIndex) {
+        producerDiagnostics[PRODUCER_DIAG_CACHE_HITS].asUint++;
+        if (frame->type == PRODUCED_FRAME_NONE) {
+            return FALSE;
+        }
+        if (frame->type == PRODUCED_FRAME_SHORT) {
+            m.opc = (onOff == EVENT_ON) ? OPC_ASON : OPC_ASOF;
+        } else {
+            m.opc = (onOff == EVENT_ON) ? OPC_ACON : OPC_ACOF;
+        }
+        m.len = 5;
+        m.bytes[0] = frame->bytes[0];
+        m.bytes[1] = frame->bytes[1];
+        m.bytes[2] = frame->bytes[2];
+        m.bytes[3] = frame->bytes[3];
+        transmit(&m);
+        producerDiagnostics[PRODUCER_DIAG_NUMPRODUCED].asUint++;
+        return TRUE;
+    }
+    frame->happening = happeningIndex;
+    if (produceEvents(happening, onOff, 1, frame) == 0) {
+        return FALSE;
+    }
+    return TRUE;
+#else
+    if (produceEvents(happening, onOff, 1, NULL) == 0) {
+        return FALSE;
+    }
+    return TRUE;
+#endif
+}
+
+#ifdef PRODUCER_INTERVAL_NV
+/**
+ * Get the time, in PRODUCER_INTERVAL_UNITs, from an NV.
+ * 
+ * @param index the NV index
+ * @return the time, 0 if the NV cannot be read
+ */
+static uint8_t getHoldTime(uint8_t index) {
+    int16_t value;
+    
+    value = getNV(index);
+    if (value < 0) return 0;
+    return (uint8_t)value;
+}
+
+/**
+ * Apply the rate limiting to a Happening's event. The minimum interval between
+ * events is in NV PRODUCER_INTERVAL_NV+happening and, if PRODUCER_DEBOUNCE_NV
+ * is defined, the time a new state must be held before it is sent is in NV 
+ * PRODUCER_DEBOUNCE_NV+happening. Whilst either time is running only the 
+ * latest state is remembered and producerPoll() sends it when the time expires,
+ * unless it is the state last sent.
+ * 
+ * @param happeningIndex the Happening
+ * @param onOff EVENT_ON for an ON event, EVENT_OFF for an OFF event
+ * @return TRUE if the event is held back, FALSE if it is to be sent now
+ */
+static Boolean holdProducedEvent(uint16_t happeningIndex, EventState onOff) {
+    uint8_t flags;
+    uint8_t wasWanted;
+#ifdef PRODUCER_DEBOUNCE_NV
+    uint8_t time;
+#endif
+    
+    if (happeningIndex > MAX_HAPPENING) return FALSE;
+    flags = happeningFlags[happeningIndex];
+    wasWanted = flags & HELD_WANTED_ON;     // only needed for the debounce
+    if (onOff == EVENT_ON) {
+        flags |= HELD_WANTED_ON;
+    } else {
+        flags &= ~HELD_WANTED_ON;
+    }
+    if (happeningTimer[happeningIndex] != 0) {
+        // hold the state until the time runs out
+        if (flags & HELD_PENDING) {
+            // the previously held state won't now be sent
+            producerDiagnostics[PRODUCER_DIAG_SUPPRESSED].asUint++;
+        }
+#ifdef PRODUCER_DEBOUNCE_NV
+        if ((flags & HELD_DEBOUNCING) && (wasWanted != (flags & HELD_WANTED_ON))) {
+            // the state changed so start the debounce time again
+            happeningTimer[happeningIndex] = getHoldTime(PRODUCER_DEBOUNCE_NV + (uint8_t)happeningIndex);
+        }
+#endif
+        happeningFlags[happeningIndex] = flags | HELD_PENDING;
+        return TRUE;
+    }
+#ifdef PRODUCER_DEBOUNCE_NV
+    time = getHoldTime(PRODUCER_DEBOUNCE_NV + (uint8_t)happeningIndex);
+    if (time != 0) {
+        happeningTimer[happeningIndex] = time;
+        happeningFlags[happeningIndex] = flags | HELD_PENDING | HELD_DEBOUNCING;
+        return TRUE;
+    }
+#endif
+    // send now and then start the interval
+    if (onOff == EVENT_ON) {
+        flags |= HELD_SENT_ON;
+    } else {
+        flags &= ~HELD_SENT_ON;
+    }
+    happeningFlags[happeningIndex] = flags | HELD_SENT_VALID;
+    happeningTimer[happeningIndex] = getHoldTime(PRODUCER_INTERVAL_NV + (uint8_t)happeningIndex);
     return FALSE;
 }
 
+/**
+ * Count down the rate limiting timers every PRODUCER_INTERVAL_UNIT and send 
+ * the held state of a Happening when its time runs out.
+ */
+static void pollHeldEvents(void) {
+    uint16_t i;
+    uint8_t flags;
+    Happening h;
+    
+    if (tickTimeSince(producerTickTime) < PRODUCER_INTERVAL_UNIT) return;
+    producerTickTime.val += PRODUCER_INTERVAL_UNIT;
+    for (i=0; i<=MAX_HAPPENING; i++) {
+        if (happeningTimer[i] == 0) continue;
+        if (--happeningTimer[i] != 0) continue;
+        flags = happeningFlags[i];
+        if ( ! (flags & HELD_PENDING)) continue;
+        flags &= ~(HELD_PENDING | HELD_DEBOUNCING);
+        if ((flags & HELD_SENT_VALID) && 
+                (((flags & HELD_WANTED_ON) != 0) == ((flags & HELD_SENT_ON) != 0))) {
+            // the final state is the one already sent
+            happeningFlags[i] = flags;
+            producerDiagnostics[PRODUCER_DIAG_SUPPRESSED].asUint++;
+            continue;
+        }
+        if (flags & HELD_WANTED_ON) {
+            flags |= HELD_SENT_ON;
+        } else {
+            flags &= ~HELD_SENT_ON;
+        }
+        happeningFlags[i] = flags | HELD_SENT_VALID;
+        happeningTimer[i] = getHoldTime(PRODUCER_INTERVAL_NV + (uint8_t)i);
+#if HAPPENING_SIZE == 2
+        h.word = i;
+#else
+        h = (Happening)i;
+#endif
+        sendProducedFrame(h, (flags & HELD_WANTED_ON) ? EVENT_ON : EVENT_OFF);
+    }
+}
+#endif
+
+/**
+ * Send all the Produced Events for the specified Happening, for example where
+ * a route setting Happening has been taught several events. The events are
+ * sent in event table order.
+ * 
+ * @param happening used to lookup the events to be sent
+ * @param onOff EVENT_ON for ON events, EVENT_OFF for OFF events
+ * @return the number of events sent
+ */
+uint8_t sendProducedEvents(Happening happening, EventState onOff) {
+#ifdef PRODUCER_STATE_CACHE
+#if HAPPENING_SIZE == 2
+    setHappeningState(happening.word, onOff);
+#else
+    setHappeningState(happening, onOff);
+#endif
+#endif
+    return produceEvents(happening, onOff, NUM_EVENTS, NULL);
+}
+
+/**
+ * Start a start of day, sending the current state of all the produced events.
+ * The responses are sent at the rate allowed by the timedResponse.
+ */
+void startSOD(void) {
+    sodAll = TRUE;
+    sodStartTime.val = tickGet();
+    startTimedResponse(TIMED_RESPONSE_SOD, findServiceIndex(SERVICE_ID_PRODUCER), sodCallback);
+}
+
+/**
+ * Start a start of day for a single Happening, sending the current state of 
+ * each of the events produced by that Happening. If a start of day for a 
+ * different Happening is already in progress then all the produced events are
+ * sent instead.
+ * 
+ * @param happening the Happening
+ */
+void startSODHappening(Happening happening) {
+    // the timedResponse may have been stopped to make room for another
+    if (timedResponseActive(TIMED_RESPONSE_SOD)) {
+#if HAPPENING_SIZE == 2
+        if (sodAll || (sodHappening.word != happening.word)) {
+#else
+        if (sodAll || (sodHappening != happening)) {
+#endif
+            startSOD();
+            return;
+        }
+    }
+    sodAll = FALSE;
+    sodHappening = happening;
+    sodStartTime.val = tickGet();
+    startTimedResponse(TIMED_RESPONSE_SOD, findServiceIndex(SERVICE_ID_PRODUCER), sodCallback);
+}
+
+/**
+ * The timedResponse callback to send the state of each produced event. The 
+ * step is used to index through the event table, jumping straight to the next
+ * entry which is the start of an event. When finished the time taken is saved
+ * in the PRODUCER_DIAG_SOD_TIME diagnostic.
+ * 
+ * @param type the type of timedResponse, TIMED_RESPONSE_SOD
+ * @param serviceIndex the index of the producer service
+ * @param step the event table index to start looking from
+ * @return the TimedResponseResult
+ */
+TimedResponseResult sodCallback(uint8_t type, uint8_t serviceIndex, uint8_t step) {
+    uint8_t tableIndex;
+    int16_t ev;
+    Happening h;
+    Event event;
+    Word producedEventNN;
+    Word producedEventEN;
+    
+    tableIndex = nextValidStart(step);
+    if (tableIndex >= NUM_EVENTS) {  // finished?
+        producerDiagnostics[PRODUCER_DIAG_SOD_TIME].asUint = (uint16_t)(tickTimeSince(sodStartTime) / ONE_MILI_SECOND);
+        return TIMED_RESPONSE_RESULT_FINISHED;
+    }
+    seekTimedResponse(tableIndex);
+    // get the happening, events without one aren't produced events
+    ev = getEv(tableIndex, 0);
+    if (ev < 0) return TIMED_RESPONSE_RESULT_SKIP;
+#if HAPPENING_SIZE == 1
+    h = (uint8_t)ev;
+    if (h > MAX_HAPPENING) return TIMED_RESPONSE_RESULT_SKIP;
+    if (( ! sodAll) && (h != sodHappening)) return TIMED_RESPONSE_RESULT_SKIP;
+#endif
+#if HAPPENING_SIZE == 2
+    h.bytes.hi = (uint8_t)ev;
+    ev = getEv(tableIndex, 1);
+    if (ev < 0) return TIMED_RESPONSE_RESULT_SKIP;
+    h.bytes.lo = (uint8_t)ev;
+    if (h.word > MAX_HAPPENING) return TIMED_RESPONSE_RESULT_SKIP;
+    if (( ! sodAll) && (h.word != sodHappening.word)) return TIMED_RESPONSE_RESULT_SKIP;
+#endif
+    getEvent(tableIndex, &event);
+    producedEventNN.word = event.NN;
+    producedEventEN.word = event.EN;
+    if (producedEventNN.word == 0) {
+        // Short event
+        if (getHappeningState(h) == EVENT_ON) {
+            sendMessage4(OPC_ARSON, nn.bytes.hi, nn.bytes.lo, producedEventEN.bytes.hi, producedEventEN.bytes.lo);
+        } else {
+            sendMessage4(OPC_ARSOF, nn.bytes.hi, nn.bytes.lo, producedEventEN.bytes.hi, producedEventEN.bytes.lo);
+        }
+    } else {
+        // Long event
+        if (getHappeningState(h) == EVENT_ON) {
+            sendMessage4(OPC_ARON, producedEventNN.bytes.hi, producedEventNN.bytes.lo, producedEventEN.bytes.hi, producedEventEN.bytes.lo);
+        } else {
+            sendMessage4(OPC_AROF, producedEventNN.bytes.hi, producedEventNN.bytes.lo, producedEventEN.bytes.hi, producedEventEN.bytes.lo);
+        }
+    }
+    return TIMED_RESPONSE_RESULT_NEXT;
+}
@@ -46,12 +46,41 @@
  * Implementation of the MERGLCB Event Producer service.
  * @details
  * Handle the production of events.
- * If EVENT_HASH_TABLE is defined then an additional lookup table 
- * uint8_t action2Event[NUM_HAPPENINGS] is used to obtain an Event 
- * using a Happening stored in the first EVs. This table is also populated using 
- * rebuildHashTable(). Given a Happening this table can be used to obtain the 
- * index into the EventTable for the Happening so the Event at that index in the 
- * EventTable can be transmitted.
+ * If EVENT_HASH_TABLE is defined then an additional lookup table is used to 
+ * obtain the Events using a Happening stored in the first EVs. The indexes into
+ * the EventTable of the events for Happening h are held in 
+ * happeningEvents[happeningEventStart[h]] up to happeningEvents[happeningEventStart[h+1]-1]
+ * so a Happening may produce any number of events. This table is also populated
+ * using rebuildHashTable() and kept up to date as events are taught. Given a 
+ * Happening this table can be used to obtain the indexes into the EventTable 
+ * so the Events at those indexes in the EventTable can be transmitted.
+ * 
+ * A start of day (SOD) is started by startSOD() or, for a single Happening, 
+ * startSODHappening(). The state of each produced event is obtained from 
+ * APP_GetEventState() and sent as an ARON/AROF, or ARSON/ARSOF for short 
+ * events, paced by the timedResponse. The time taken by the last SOD is 
+ * available as a diagnostic.
+ * 
+ * If PRODUCER_INTERVAL_NV is defined then the events sent by sendProducedEvent()
+ * are rate limited per Happening so that a noisy input cannot flood the bus. 
+ * After an event is sent no further event for that Happening is sent until the
+ * minimum interval has passed. Changes of state during the interval are 
+ * suppressed and only the final state is sent when the interval expires, if it
+ * differs from the state last sent. If PRODUCER_DEBOUNCE_NV is also defined 
+ * then a new state must remain unchanged for the debounce time before it is 
+ * sent. The number of suppressed events is available as a diagnostic. 
+ * sendProducedEvents() is not rate limited.
+ * 
+ * AREQ and ASRQ status requests are answered with the state obtained from 
+ * APP_GetEventState(). If PRODUCER_STATE_CACHE is defined the state last passed
+ * to sendProducedEvent() or sendProducedEvents() is used instead, so the 
+ * application is only asked about Happenings it has not yet sent. The 
+ * application must then send an event for every change of state. If 
+ * PRODUCER_AREQ_QUEUE_SIZE is defined then, when the transport's transmit 
+ * buffers are full, requests are queued and answered as space becomes free so
+ * that a burst of requests, such as from JMRI at startup, does not overflow 
+ * the transmit buffers. Requests arriving while the queue is full are not
+ * answered and are counted in PRODUCER_DIAG_AREQ_DROPPED.
  * 
  * # Dependencies on other Services
  * The Event Producer service depends upon the Event Teach service. The Event
@@ -66,6 +95,25 @@
  * - #define PRODUCED_EVENTS    Always defined whenever the Event Producer service is included
  * - #define HAPPENING_SIZE        Set to the number of bytes to hold a Happening.
  *                               Can be either 1 or 2.
+ * - #define PRODUCED_EVENT_CACHE_SIZE Optional. If defined the events sent by
+ *                               sendProducedEvent() for this many Happenings 
+ *                               are kept ready to send in RAM, 7 bytes each.
+ * - #define PRODUCER_INTERVAL_NV Optional. The first of MAX_HAPPENING+1 NVs, one
+ *                               for each Happening, holding the minimum interval 
+ *                               between its events. 0 for no limit. Uses 2 bytes
+ *                               of RAM for each Happening.
+ * - #define PRODUCER_DEBOUNCE_NV Optional. The first of MAX_HAPPENING+1 NVs 
+ *                               holding the time a new state must be held before
+ *                               it is sent. 0 for no debounce.
+ * - #define PRODUCER_INTERVAL_UNIT Optional. The unit of the interval and debounce
+ *                               NVs. Defaults to TEN_MILI_SECOND.
+ * - #define PRODUCER_STATE_CACHE Optional. If defined the state of each Happening
+ *                               is kept in RAM to answer AREQ/ASRQ and SOD.
+ * - #define PRODUCER_AREQ_QUEUE_SIZE Optional. The number of AREQ/ASRQ which can
+ *                               be waiting for transmit space, 7 bytes each.
+ * - #define PRODUCER_TX_RESERVE  Optional. Answers are queued when the transport 
+ *                               has this many or fewer free transmit buffers. 
+ *                               Defaults to 0.
  * 
  */
 
@@ -73,14 +121,30 @@
 extern const Service eventProducerService;
 
 #ifdef EVENT_HASH_TABLE
-extern uint8_t happening2Event[MAX_HAPPENING+1];
+extern uint8_t happeningEventStart[MAX_HAPPENING+2];
+extern uint8_t happeningEvents[NUM_EVENTS];
 #endif
 
-#define NUM_PRODUCER_DIAGNOSTICS    1   ///< Number of diagnostics for this service
+#define NUM_PRODUCER_DIAGNOSTICS    5   ///< Number of diagnostics for this service
 #define PRODUCER_DIAG_NUMPRODUCED   0   ///< Number of events produced
+#define PRODUCER_DIAG_SOD_TIME      1   ///< Time in ms taken by the last start of day
+#define PRODUCER_DIAG_CACHE_HITS    2   ///< Number of events sent using producedCache
+#define PRODUCER_DIAG_SUPPRESSED    3   ///< Number of events not sent due to rate limiting
+#define PRODUCER_DIAG_AREQ_DROPPED  4   ///< Number of AREQ/ASRQ not answered as the queue was full
+
 
+extern Boolean sendProducedEvent(Happening h, EventState state);
+extern uint8_t sendProducedEvents(Happening h, EventState state);
 
-extern Boolean sendProducedEvent(Happening h, EventState state); 
+/*
+ * Start sending the state of all the produced events, for example when the
+ * module's start of day event is received.
+ */
+extern void startSOD(void);
+/*
+ * Start sending the state of the events produced by a Happening.
+ */
+extern void startSODHappening(Happening h);
 
 //AREQ stuff
 /**
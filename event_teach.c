@@ -60,6 +60,7 @@
 #include "romops.h"
 #include "mns.h"
 #include "timedResponse.h"
+#include "ticktime.h"
 #include "event_teach.h"
 
 /**
@@ -79,6 +80,25 @@
  *
  * This generic code needs no knowledge of specific EV usage.
  *
+ * Whilst in Learn mode, or after beginTeachTransaction(), changes to the event
+ * table are held in the flash buffer rather than being flushed after every EV.
+ * The flash is written when Learn mode is exited, when commitTeachTransaction()
+ * is called or when no changes have been made for TEACH_TRANSACTION_TIMEOUT.
+ * Reads of the event table always see the pending changes.
+ *
+ * Over time the rows of events with chained entries become scattered across the
+ * table. defragEventTable() relocates rows so that each event's rows are 
+ * contiguous and all of the free rows are at the end of the table. If 
+ * EVENT_DEFRAG_AT_IDLE is defined this is also done a step at a time whilst in
+ * Normal mode after the table has been changed. Compaction waits until no 
+ * timedResponse, such as NERD or a start of day, is in progress and EN# indexes
+ * have not been sent by NERD or read by NENRD or REVAL for EVENT_DEFRAG_DELAY.
+ * Note that this changes the EN# index of events.
+ * 
+ * Rows are moved by swapping pairs of rows. The new contents of both rows are
+ * first written to a journal at EVENT_DEFRAG_JOURNAL_ADDRESS, so that a swap 
+ * interrupted by a reset is completed at the next power up.
+ *
  * @warning
  * BEWARE must set NUM_EVENTS to a maximum of 255!
  * If set to 256 then the for (uint8_t i=0; i<NUM_EVENTS; i++) loops will never end
@@ -117,6 +137,13 @@
  * size of a row is 16bytes. A chain of two rows can store 20 EVs. CANMIO has a 
  * limit of 20 EVs per event (EVperEVT) so that a maximum of 2 entries are chained.
  * 
+ * If EVENT_TABLE_COMPACT is defined then rows are only 6+EVENT_TABLE_WIDTH bytes
+ * and the 4 bytes of the 'event' field of continuation rows are used for EVs, 
+ * so that each continuation row holds EVENT_TABLE_WIDTH+4 EVs. A module whose 
+ * events mostly use 2 EVs can then set EVENT_TABLE_WIDTH to 2 and store twice
+ * as many events in the same memory, with the occasional event needing more 
+ * EVs using continuation rows.
+ * 
  * The 'event' field is only used in the first in a chain of entries and contains 
  * the NN/EN of the event.
  * 
@@ -191,7 +218,19 @@
  * This function must be called before attempting to use the hash table. Each Event 
  * from the EventTable is hashed using getHash(nn,en), trimmed to the HASH_LENGTH 
  * and the index in the EventTable is then stored in the eventChains at the next 
- * available bucket position.
+ * available bucket position. After power up the table is maintained incrementally,
+ * hashInsert() adding an event to its chain and to the Happening index and 
+ * hashRemove() taking it out again, so that teaching an event doesn't require
+ * the whole EventTable to be rescanned.
+ * 
+ * Alongside each index in eventChains an 8 bit fingerprint of the NN/EN, from
+ * getFingerprint(), is held in RAM. Only candidates whose fingerprint matches 
+ * are read from NVM to confirm the match, so an event which isn't in the table 
+ * is normally rejected without any NVM reads. If an event's chain is full it 
+ * is put into the eventOverflow list, which is also searched whenever it is not
+ * empty. Should that be full as well then hashIncomplete is set and findEvent()
+ * also searches the whole table, so events are never lost from the index. The 
+ * load on the index is available as diagnostics.
  * 
  * When an Event is received from CBUS and we need to find its index within the 
  * EventTable it is firstly hashed using getHash(nn,en), trimmed to HASH_LENGTH 
@@ -201,22 +240,67 @@
  * received event. It it does match then the index into eventtable has been found 
  * and is returned. The EVs can then be accessed from the ev[] field.
  * 
+ * To avoid reading the flags of every row from NVM when searching the table, 
+ * two RAM bitmaps with a bit per row are also maintained: freeSlots has the bit
+ * set for rows with the freeEntry flag set and validStarts has the bit set for
+ * rows which are the start of an event. These are built from the EventTable at
+ * power up and are updated whenever a row's flags are written using 
+ * writeFlags(). Finding a free row is then a search for the first set bit and 
+ * counting free rows or events is a count of the set bits.
+ * 
  */
 
 // forward definitions
 static void teachFactoryReset(void);
 static void teachPowerUp(void);
+static void teachPoll(void);
 static Processed teachProcessMessage(Message * m);
 static uint8_t teachGetESDdata(uint8_t id);
 static DiagnosticVal * teachGetDiagnostic(uint8_t code);
 static void clearAllEvents(void);
+static void teachChanged(void);
+static Boolean defragStep(void);
+static void swapRows(uint8_t a, uint8_t preA, uint8_t b);
+static uint8_t findPredecessor(uint8_t tableIndex);
+static uint16_t journalCheck(void);
+static void applyJournal(void);
+static void recoverJournal(void);
+static void clearJournal(void);
+static void writeFlags(uint8_t tableIndex, uint8_t flags);
+static void setOccupancy(uint8_t tableIndex, uint8_t flags);
+static void rebuildOccupancy(void);
+static uint8_t findNextInMap(uint8_t * map, uint8_t tableIndex);
+static uint8_t countMap(uint8_t * map);
+static uint8_t matchEvent(uint8_t tableIndex, uint16_t nodeNumber, uint16_t eventNumber);
+#ifdef EVENT_FIXED_HASH_ADDRESS
+static uint16_t fixedHash(uint16_t nodeNumber, uint16_t eventNumber, uint8_t seed);
+static uint8_t fixedHashScale(uint16_t hash, uint8_t n);
+static uint8_t fixedHashFind(uint16_t nodeNumber, uint16_t eventNumber);
+static Boolean fixedHashCheck(void);
+static void fixedHashInvalidate(void);
+#endif
+#ifdef EVENT_HASH_TABLE
+static uint8_t getFingerprint(uint16_t nodeNumber, uint16_t eventNumber);
+static void hashInsert(uint8_t tableIndex);
+static void hashRemove(uint8_t tableIndex);
+static void hashRemoved(void);
+static void hashSwap(uint8_t a, uint8_t b);
+#ifdef PRODUCED_EVENTS
+static void happeningInsert(uint16_t happening, uint8_t tableIndex);
+static void happeningRemove(uint8_t tableIndex);
+static uint16_t getHappeningIndex(uint8_t tableIndex);
+#endif
+#endif
 Processed checkLen(Message * m, uint8_t needed);
 static uint8_t evtIdxToTableIndex(uint8_t evtIdx);
 TimedResponseResult nerdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step);
 TimedResponseResult reqevCallback(uint8_t type, uint8_t serviceIndex, uint8_t step);
 Boolean validStart(uint8_t tableIndex);
+uint8_t nextValidStart(uint8_t tableIndex);
 uint16_t getNN(uint8_t tableIndex);
 uint16_t getEN(uint8_t tableIndex);
+void getEvent(uint8_t tableIndex, Event * event);
+void readEventRow(uint8_t tableIndex, EventTable * row);
 uint8_t numEv(uint8_t tableIndex);
 int16_t getEv(uint8_t tableIndex, uint8_t evNum);
 static uint8_t tableIndexToEvtIdx(uint8_t tableIndex);
@@ -247,20 +331,133 @@ const Service eventTeachService = {
     teachFactoryReset,  // factoryReset
     teachPowerUp,       // powerUp
     teachProcessMessage,// processMessage
-    NULL,               // poll
+    teachPoll,          // poll
     NULL,               // highIsr
     NULL,               // lowIsr
     teachGetESDdata,    // get ESD data
-    NULL                // getDiagnostic
+    teachGetDiagnostic  // getDiagnostic
 };
 
 // Space for the event table and initialise to 0xFF
 static const uint8_t eventTable[NUM_EVENTS * EVENTTABLE_ROW_WIDTH] __at(EVENT_TABLE_ADDRESS) ={[0 ... NUM_EVENTS * EVENTTABLE_ROW_WIDTH-1] = 0xFF};
 
+#ifdef EVENT_FIXED_HASH_ADDRESS
+// Space for the perfect hash of the events, initially invalid
+static const uint8_t eventFixedHash[EVENT_FIXED_HASH_SIZE] __at(EVENT_FIXED_HASH_ADDRESS) ={[0 ... EVENT_FIXED_HASH_SIZE-1] = 0xFF};
+
+// Layout of the perfect hash in flash
+#define FIXED_HASH_OFFSET_MARKER    0
+#define FIXED_HASH_OFFSET_KEYS      1
+#define FIXED_HASH_OFFSET_BUCKETS   2
+#define FIXED_HASH_OFFSET_SEEDS     3
+#define FIXED_HASH_OFFSET_DIRECT    (FIXED_HASH_OFFSET_SEEDS+FIXED_HASH_MAX_BUCKETS)
+#define FIXED_HASH_OFFSET_SLOTS     (FIXED_HASH_OFFSET_DIRECT+(FIXED_HASH_MAX_BUCKETS+7)/8)
+#define FIXED_HASH_VALID            0x5A
+#define FIXED_HASH_MAX_BUCKET_SIZE  8
+
+static Boolean fixedHashValid;          // the perfect hash covers the current events
+static uint8_t fixedHashKeys;           // number of events in the perfect hash
+static uint8_t fixedHashBuckets;        // number of buckets in the perfect hash
+#endif
+
+// RAM copies of the row state, one bit per row of the event table
+#define OCCUPANCY_MAP_SIZE  ((NUM_EVENTS+7)/8)
+static uint8_t freeSlots[OCCUPANCY_MAP_SIZE];
+static uint8_t validStarts[OCCUPANCY_MAP_SIZE];
+
+static DiagnosticVal teachDiagnostics[NUM_TEACH_DIAGNOSTICS];
+
+/**
+ * The time after the last change within a teach transaction before the changes
+ * are written to flash. May be overridden in module.h.
+ */
+#ifndef TEACH_TRANSACTION_TIMEOUT
+#define TEACH_TRANSACTION_TIMEOUT   ONE_SECOND
+#endif
+/**
+ * The time after the event table was last changed, or EN# indexes were last 
+ * read, before the idle compaction starts. May be overridden in module.h.
+ */
+#ifndef EVENT_DEFRAG_DELAY
+#define EVENT_DEFRAG_DELAY  (60*ONE_SECOND)
+#endif
+/**
+ * The address of the journal which allows a swap of two rows of the event 
+ * table to be completed after a reset. Needs DEFRAG_JOURNAL_SIZE bytes of 
+ * EVENT_TABLE_NVM_TYPE. May be overridden in module.h.
+ */
+#ifndef EVENT_DEFRAG_JOURNAL_ADDRESS
+#define EVENT_DEFRAG_JOURNAL_ADDRESS    (EVENT_TABLE_ADDRESS + NUM_EVENTS*EVENTTABLE_ROW_WIDTH)
+#endif
+// the teach transaction states
+#define TEACH_TRANSACTION_NONE      0
+#define TEACH_TRANSACTION_LEARN     1   // started by entering Learn mode
+#define TEACH_TRANSACTION_EXPLICIT  2   // started by beginTeachTransaction()
+static uint8_t teachTransaction;
+static Boolean teachPending;            // changes not yet written to flash
+static TickValue teachChangeTime;       // time of the last change
+
+static uint8_t defragCursor;            // rows before this have been compacted
+static Boolean defragWanted;            // table has changed since last compaction
+static Boolean defragMoved;             // rows have been moved in this compaction
+static TickValue defragHoldTime;        // the last change or use of the EN# indexes
+static Boolean defragJournalled;        // the journal holds a swap not yet cleared
+
+/*
+ * The journal of a swap of two rows. The new contents of both rows are written
+ * here, and to NVM, before either row is changed, and the marker is cleared 
+ * once the rows have been written. If the module is reset in between, the
+ * swap is written again at power up.
+ */
+#define DEFRAG_JOURNAL_OFFSET_MARKER    0
+#define DEFRAG_JOURNAL_OFFSET_A         1   // the rows to be written
+#define DEFRAG_JOURNAL_OFFSET_B         2
+#define DEFRAG_JOURNAL_OFFSET_PRE_A     3   // a row whose next becomes NEXT_A, or NO_INDEX
+#define DEFRAG_JOURNAL_OFFSET_NEXT_A    4
+#define DEFRAG_JOURNAL_OFFSET_PRE_B     5   // a row whose next becomes NEXT_B, or NO_INDEX
+#define DEFRAG_JOURNAL_OFFSET_NEXT_B    6
+#define DEFRAG_JOURNAL_OFFSET_ROW_A     7
+#define DEFRAG_JOURNAL_OFFSET_ROW_B     (DEFRAG_JOURNAL_OFFSET_ROW_A+EVENTTABLE_ROW_WIDTH)
+#define DEFRAG_JOURNAL_OFFSET_CHECK     (DEFRAG_JOURNAL_OFFSET_ROW_B+EVENTTABLE_ROW_WIDTH)
+#define DEFRAG_JOURNAL_SIZE             (DEFRAG_JOURNAL_OFFSET_CHECK+2)
+#define DEFRAG_JOURNAL_PENDING          0xA5    // the rows may not have been written
+#define DEFRAG_JOURNAL_DONE             0x00    // clearing bits needs no erase
+static uint8_t journal[DEFRAG_JOURNAL_SIZE];
+
+// Space for the journal of a swap of event table rows, initially empty
+static const uint8_t eventDefragJournal[DEFRAG_JOURNAL_SIZE] __at(EVENT_DEFRAG_JOURNAL_ADDRESS) ={[0 ... DEFRAG_JOURNAL_SIZE-1] = 0xFF};
+
+/*
+ * Set to all ones whenever events are added, changed, removed or moved within 
+ * the event table. Each service which decodes from the table clears its own 
+ * bit once it has forgotten what it decoded.
+ */
+uint8_t eventTableChanged;
+
 #ifdef EVENT_HASH_TABLE
+/**
+ * The number of events which can be held in the overflow list when their 
+ * hash chain is full. May be overridden in module.h.
+ */
+#ifndef EVENT_OVERFLOW_LENGTH
+#define EVENT_OVERFLOW_LENGTH   8
+#endif
 uint8_t eventChains[EVENT_HASH_LENGTH][EVENT_CHAIN_LENGTH];
+static uint8_t eventChainPrints[EVENT_HASH_LENGTH][EVENT_CHAIN_LENGTH];
+static uint8_t eventOverflow[EVENT_OVERFLOW_LENGTH];
+static uint8_t eventOverflowPrints[EVENT_OVERFLOW_LENGTH];
+static uint8_t numOverflow;         // number of entries used in eventOverflow
+static Boolean hashIncomplete;      // TRUE if some events could not be indexed
 #ifdef PRODUCED_EVENTS
-uint8_t happening2Event[MAX_HAPPENING+1];
+/*
+ * The events produced by each Happening. The indexes of the events for 
+ * Happening h are happeningEvents[happeningEventStart[h]] up to, but not 
+ * including, happeningEvents[happeningEventStart[h+1]], in event table order.
+ * A Happening may therefore produce any number of events whilst the index only
+ * needs a byte per Happening and a byte per event.
+ */
+uint8_t happeningEventStart[MAX_HAPPENING+2];
+uint8_t happeningEvents[NUM_EVENTS];
 #endif
 #endif
 
@@ -273,15 +470,113 @@ uint8_t happening2Event[MAX_HAPPENING+1];
  */
 static void teachFactoryReset(void) {
     clearAllEvents();
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    fixedHashInvalidate();
+#endif
 }
 
 /**
- * Power up loads the RAM based hash tables from the non volatile event table.
+ * Power up loads the RAM based occupancy maps and hash tables from the non 
+ * volatile event table.
  */
 static void teachPowerUp(void) {
+    eventTableChanged = EVENT_TABLE_CHANGED_ALL;
+    teachTransaction = TEACH_TRANSACTION_NONE;
+    teachPending = FALSE;
+    defragCursor = 0;
+    defragWanted = FALSE;
+    defragMoved = FALSE;
+    defragHoldTime.val = tickGet();
+    defragJournalled = FALSE;
+    // finish any swap of rows which was interrupted by a reset
+    recoverJournal();
+    rebuildOccupancy();
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    // use the perfect hash if it still finds every event, otherwise rebuild
+    // it. The table may have been written directly, such as by an image import.
+    fixedHashValid = FALSE;
+    if (((uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_MARKER) == FIXED_HASH_VALID)
+            && ((uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_KEYS) == countMap(validStarts))) {
+        fixedHashKeys = (uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_KEYS);
+        fixedHashBuckets = (uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_BUCKETS);
+        fixedHashValid = fixedHashCheck();
+    }
+    if ( ! fixedHashValid) {
+        buildFixedEventHash();
+    }
+#endif
+}
+
+/**
+ * Manage teach transactions. A transaction is started when Learn mode is 
+ * entered and committed when it is exited. Pending changes are written to flash
+ * once there have been no changes for TEACH_TRANSACTION_TIMEOUT.
+ */
+static void teachPoll(void) {
+    if (mode == MODE_LEARN) {
+        if (teachTransaction == TEACH_TRANSACTION_NONE) {
+            teachTransaction = TEACH_TRANSACTION_LEARN;
+        }
+    } else if (teachTransaction == TEACH_TRANSACTION_LEARN) {
+        commitTeachTransaction();
+    }
+    if (teachPending && (tickTimeSince(teachChangeTime) > TEACH_TRANSACTION_TIMEOUT)) {
+        flushFlashBlock();
+        teachPending = FALSE;
+    }
+#ifdef EVENT_DEFRAG_AT_IDLE
+    // compact one event at a time when nothing else is happening. Rows must 
+    // not move whilst a timedResponse is walking the table or soon after 
+    // EN# indexes have been read.
+    if (defragWanted && (mode == MODE_NORMAL) && (teachTransaction == TEACH_TRANSACTION_NONE)
+            && ( ! timedResponseActive(TIMED_RESPONSE_NONE))
+            && (tickTimeSince(defragHoldTime) > EVENT_DEFRAG_DELAY)) {
+        if ( ! defragStep()) {
+            defragWanted = FALSE;
+        }
+    }
+#endif
+}
+
+/**
+ * Start a teach transaction. Changes to the event table are not written to 
+ * flash until commitTeachTransaction() is called or there have been no changes 
+ * for TEACH_TRANSACTION_TIMEOUT.
+ */
+void beginTeachTransaction(void) {
+    teachTransaction = TEACH_TRANSACTION_EXPLICIT;
+}
+
+/**
+ * End a teach transaction, writing any pending changes to flash.
+ */
+void commitTeachTransaction(void) {
+    teachTransaction = TEACH_TRANSACTION_NONE;
+    if (teachPending) {
+        flushFlashBlock();
+        teachPending = FALSE;
+    }
+}
+
+/**
+ * Called after the event table has been changed. Outside of a transaction the 
+ * changes are written to flash immediately, otherwise they are left pending.
+ */
+static void teachChanged(void) {
+    eventTableChanged = EVENT_TABLE_CHANGED_ALL;
+    // start compaction again from the beginning
+    defragCursor = 0;
+    defragWanted = TRUE;
+    defragHoldTime.val = tickGet();
+    if (teachTransaction == TEACH_TRANSACTION_NONE) {
+        flushFlashBlock();
+    } else {
+        teachPending = TRUE;
+        teachChangeTime.val = tickGet();
+    }
 }
 
 /**
@@ -419,6 +714,73 @@ static uint8_t teachGetESDdata(uint8_t id) {
     }
 }
 
+/**
+ * Provide the means to return the diagnostic data. The index statistics are
+ * calculated when requested.
+ * @param index the diagnostic index 1..NUM_TEACH_DIAGNOSTICS
+ * @return a pointer to the diagnostic data or NULL if the data isn't available
+ */
+static DiagnosticVal * teachGetDiagnostic(uint8_t index) {
+#ifdef EVENT_HASH_TABLE
+    uint8_t hash;
+    uint8_t chainIdx;
+    uint16_t used;
+    uint8_t longest;
+#endif
+    EventTableFlags f;
+    uint8_t tableIndex;
+    uint8_t next;
+    uint8_t scattered;
+    uint8_t gaps;
+    uint8_t freeRows;
+    
+    if ((index<1) || (index>NUM_TEACH_DIAGNOSTICS)) {
+        return NULL;
+    }
+    // fragmentation of the table
+    scattered = 0;
+    gaps = 0;
+    freeRows = 0;
+    for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        if (freeSlots[tableIndex >> 3] & (1 << (tableIndex & 7))) {
+            freeRows++;
+            continue;
+        }
+        // a used row so all free rows before it are gaps
+        gaps = freeRows;
+        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+        if (f.continued) {
+            next = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+            if (next != tableIndex+1) {
+                scattered++;
+            }
+        }
+    }
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    teachDiagnostics[TEACH_DIAGNOSTICS_FIXED_HASH].asUint = fixedHashValid;
+#endif
+    teachDiagnostics[TEACH_DIAGNOSTICS_SCATTERED].asUint = scattered;
+    teachDiagnostics[TEACH_DIAGNOSTICS_FREE_GAPS].asUint = gaps;
+#ifdef EVENT_HASH_TABLE
+    used = 0;
+    longest = 0;
+    for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
+        for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+            if (eventChains[hash][chainIdx] == NO_INDEX) break;
+        }
+        used += chainIdx;
+        if (chainIdx > longest) {
+            longest = chainIdx;
+        }
+    }
+    teachDiagnostics[TEACH_DIAGNOSTICS_HASH_LOAD].asUint = (uint16_t)((used * 100) / (EVENT_HASH_LENGTH * EVENT_CHAIN_LENGTH));
+    teachDiagnostics[TEACH_DIAGNOSTICS_LONGEST_CHAIN].asUint = longest;
+    teachDiagnostics[TEACH_DIAGNOSTICS_OVERFLOW].asUint = numOverflow;
+    teachDiagnostics[TEACH_DIAGNOSTICS_UNINDEXED].asUint = hashIncomplete;
+#endif
+    return &(teachDiagnostics[index-1]);
+}
+
 //
 // FUNCTIONS TO DO THE ACTUAL WORK
 //
@@ -430,9 +792,9 @@ static void clearAllEvents(void) {
     uint8_t tableIndex;
     for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
         // set the free flag
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex + EVENTTABLE_OFFSET_FLAGS, 0xff);
+        writeFlags(tableIndex, 0xff);
     }
-    flushFlashBlock();
+    teachChanged();
 #ifdef EVENT_HASH_TABLE
     rebuildHashtable();
 #endif
@@ -444,16 +806,7 @@ static void clearAllEvents(void) {
  */
 static void doNnevn(void) {
     // count the number of unused slots.
-    uint8_t count = 0;
-    uint8_t i;
-    for (i=0; i<NUM_EVENTS; i++) {
-        EventTableFlags f;
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_FLAGS);
-        if (f.freeEntry) {
-            count++;
-        }
-    }
-    sendMessage3(OPC_EVNLF, nn.bytes.hi, nn.bytes.lo, count);
+    sendMessage3(OPC_EVNLF, nn.bytes.hi, nn.bytes.lo, countMap(freeSlots));
 } // doNnevn
 
 
@@ -474,16 +827,22 @@ static void doNerd(void) {
  */
 TimedResponseResult nerdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step){
     Word nodeNumber, eventNumber;
-    // The step is used to index through the event table
-    if (step >= NUM_EVENTS) {  // finished?
+    Event event;
+    uint8_t tableIndex;
+    
+    // The step is used to index through the event table, jumping straight to 
+    // the next entry which is the start of an event
+    tableIndex = nextValidStart(step);
+    // the EN# indexes sent may be used by REVAL after the responses are done
+    defragHoldTime.val = tickGet();
+    if (tableIndex >= NUM_EVENTS) {  // finished?
         return TIMED_RESPONSE_RESULT_FINISHED;
     }
-    // if its not free and not a continuation then it is start of an event
-    if (validStart(step)) {
-        nodeNumber.word = getNN(step);
-        eventNumber.word = getEN(step);
-        sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(step));
-    }
+    seekTimedResponse(tableIndex);
+    getEvent(tableIndex, &event);
+    nodeNumber.word = event.NN;
+    eventNumber.word = event.EN;
+    sendMessage7(OPC_ENRSP, nn.bytes.hi, nn.bytes.lo, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, tableIndexToEvtIdx(tableIndex));
     return TIMED_RESPONSE_RESULT_NEXT;
 }
 
@@ -497,7 +856,9 @@ TimedResponseResult nerdCallback(uint8_t type, uint8_t serviceIndex, uint8_t ste
 static void doNenrd(uint8_t index) {
     uint8_t tableIndex;
     uint16_t nodeNumber, eventNumber;
+    Event event;
     
+    defragHoldTime.val = tickGet();     // the index may be used by REVAL
     tableIndex = evtIdxToTableIndex(index);
     // check this is a valid index
     if ( ! validStart(tableIndex)) {
@@ -507,8 +868,9 @@ static void doNenrd(uint8_t index) {
 //        cbusSendOpcMyNN( 0, OPC_ENRSP, cbusMsg );
         return;
     }
-    nodeNumber = getNN(tableIndex);
-    eventNumber = getEN(tableIndex);
+    getEvent(tableIndex, &event);
+    nodeNumber = event.NN;
+    eventNumber = event.EN;
     sendMessage5(OPC_ENRSP, nodeNumber>>8, nodeNumber&0xFF, eventNumber>>8, eventNumber&0xFF, index);
 
 } // doNenrd
@@ -519,15 +881,8 @@ static void doNenrd(uint8_t index) {
  * in the Event table.
  */
 static void doRqevn(void) {
-    // Count the number of used slots.
-    uint8_t count = 0;
-    uint8_t i;
-    for (i=0; i<NUM_EVENTS; i++) {
-        if (validStart(i)) {
-            count++;    
-        }
-    }
-    sendMessage3(OPC_NUMEV, nn.bytes.hi, nn.bytes.lo, count);
+    // Count the number of events.
+    sendMessage3(OPC_NUMEV, nn.bytes.hi, nn.bytes.lo, countMap(validStarts));
 } // doRqevn
 
 /**
@@ -581,6 +936,7 @@ static void doReval(uint8_t enNum, uint8_t evNum) {
     uint8_t evIndex;
     uint8_t tableIndex = evtIdxToTableIndex(enNum);
     
+    defragHoldTime.val = tickGet();
     if (evNum > PARAM_NUM_EV_EVENT) {
         sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, CMDERR_INV_EV_IDX);
         return;
@@ -664,6 +1020,7 @@ static void doReqev(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum) {
  */
 TimedResponseResult reqevCallback(uint8_t tableIndex, uint8_t serviceIndex, uint8_t step){
     Word nodeNumber, eventNumber;
+    Event event;
 
     uint8_t nEv = numEv(tableIndex);
     int16_t ev;
@@ -671,13 +1028,16 @@ TimedResponseResult reqevCallback(uint8_t tableIndex, uint8_t serviceIndex, uint
     if (step+1 > nEv) {  // finished?
         return TIMED_RESPONSE_RESULT_FINISHED;
     }
-    // if its not free and not a continuation then it is start of an event
-    nodeNumber.word = getNN(tableIndex);
-    eventNumber.word = getEN(tableIndex);
     ev = getEv(tableIndex, step);
-    if (ev >= 0) {
-        sendMessage6(OPC_EVANS, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, step+1, (uint8_t)ev);
+    if (ev < 0) {
+        // nothing to send so go straight on to the next EV
+        return TIMED_RESPONSE_RESULT_SKIP;
     }
+    // if its not free and not a continuation then it is start of an event
+    getEvent(tableIndex, &event);
+    nodeNumber.word = event.NN;
+    eventNumber.word = event.EN;
+    sendMessage6(OPC_EVANS, nodeNumber.bytes.hi, nodeNumber.bytes.lo, eventNumber.bytes.hi, eventNumber.bytes.lo, step+1, (uint8_t)ev);
     return TIMED_RESPONSE_RESULT_NEXT;
 }
 
@@ -704,33 +1064,39 @@ uint8_t removeEvent(uint16_t nodeNumber, uint16_t eventNumber) {
  */
 static uint8_t removeTableEntry(uint8_t tableIndex) {
     EventTableFlags f;
+    uint8_t startIndex = tableIndex;
 
 #ifdef SAFETY
     if (tableIndex >= NUM_EVENTS) return CMDERR_INV_EV_IDX;
 #endif
     if (validStart(tableIndex)) {
+        uint8_t error = 0;
+        // remember whether there are chained entries before clearing the flags
+        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
         // set the free flag
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, 0xff);
+        writeFlags(tableIndex, 0xff);
         // Now follow the next pointer
-        f.asByte = 0xff;
         while (f.continued) {
             tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+            if (tableIndex >= NUM_EVENTS) {
+                // shouldn't be necessary
+                error = CMDERR_INV_EV_IDX;
+                break;
+            }
             f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
         
-            if (tableIndex >= NUM_EVENTS) return CMDERR_INV_EV_IDX; // shouldn't be necessary
-        
             // the continuation flag of this entry should be set but I'm 
             // not going to check as I wouldn't know what to do if it wasn't set
                     
             // set the free flag
-            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, 0xff);
+            writeFlags(tableIndex, 0xff);
         
         }
-        flushFlashBlock();
+        teachChanged();
 #ifdef EVENT_HASH_TABLE
-        // easier to rebuild from scratch
-        rebuildHashtable();
+        hashRemove(startIndex);
 #endif
+        return error;
     }
     return 0;
 }
@@ -763,48 +1129,51 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
         if (evVal == EV_FILL) {
             return 0;
         }
-        error = 1;
         // didn't find the event so find an empty slot and create one
-        for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
+        tableIndex = findNextInMap(freeSlots, 0);
+        if (tableIndex >= NUM_EVENTS) {
+            return CMDERR_TOO_MANY_EVENTS;
+        } else {
             EventTableFlags f;
-            f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-            if (f.freeEntry) {
-                uint8_t e;
-                // found a free slot, initialise it
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN, nodeNumber&0xFF);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN+1, nodeNumber>>8);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN, eventNumber&0xFF);
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN+1, eventNumber>>8);
-                f.asByte = 0;
-                f.forceOwnNN = forceOwnNN;
-                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, f.asByte);
+            uint8_t e;
+            // found a free slot, initialise it
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN, nodeNumber&0xFF);
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NN+1, nodeNumber>>8);
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN, eventNumber&0xFF);
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EN+1, eventNumber>>8);
+            f.asByte = 0;
+            f.forceOwnNN = forceOwnNN;
+            writeFlags(tableIndex, f.asByte);
             
-                for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+e, EV_FILL);
-                }
-//                flushFlashBlock();
-//#ifdef EVENT_HASH_TABLE
-//                rebuildHashtable();
-//#endif
-                error = 0;
-                break;
+            for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+e, EV_FILL);
             }
         }
-        if (error) {
-            return CMDERR_TOO_MANY_EVENTS;
-        }
     }
+#if defined(EVENT_HASH_TABLE) && defined(PRODUCED_EVENTS)
+    else if (evNum < HAPPENING_SIZE) {
+        // the Happening may be changing so take the event out of the Happening
+        // index. The hash chains depend only upon NN/EN so are left alone, 
+        // otherwise a rebuild here would index it again under the old Happening.
+        happeningRemove(tableIndex);
+    }
+#endif
  
     if (writeEv(tableIndex, evNum, evVal)) {
         // failed to write
-        return CMDERR_INV_EV_IDX;
+        error = CMDERR_INV_EV_IDX;
+    } else {
+        // success
+        error = 0;
     }
-    // success
-    flushFlashBlock();
+    teachChanged();
 #ifdef EVENT_HASH_TABLE
-    rebuildHashtable();
+    // the event may have been removed if all its EVs have been cleared
+    if (validStart(tableIndex)) {
+        hashInsert(tableIndex);
+    }
 #endif
-    return 0;
+    return error;
 }
 
 /**
@@ -815,34 +1184,42 @@ uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8
  * @return index into event table or NO_INDEX if not present
  */
 uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t tableIndex;
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    if (fixedHashValid) {
+        // the hash covers every event so there is no need to look further
+        return fixedHashFind(nodeNumber, eventNumber);
+    }
+#endif
 #ifdef EVENT_HASH_TABLE
     uint8_t hash = getHash(nodeNumber, eventNumber);
+    uint8_t fingerprint = getFingerprint(nodeNumber, eventNumber);
     uint8_t chainIdx;
     for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
-        uint8_t tableIndex = eventChains[hash][chainIdx];
-        uint16_t nodeNumber, en;
-        if (tableIndex == NO_INDEX) return NO_INDEX;
-        nodeNumber = getNN(tableIndex);
-        en = getEN(tableIndex);
-        if ((nn.word == nodeNumber) && (en == eventNumber)) {
+        tableIndex = eventChains[hash][chainIdx];
+        if (tableIndex == NO_INDEX) break;
+        if ((eventChainPrints[hash][chainIdx] == fingerprint) && matchEvent(tableIndex, nodeNumber, eventNumber)) {
             return tableIndex;
         }
     }
-#else
-    uint8_t tableIndex;
-    for (tableIndex=0; tableIndex < NUM_EVENTS; tableIndex++) {
-        EventTableFlags f;
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-        if (( ! f.freeEntry) && ( ! f.continuation)) {
-            uint16_t node, en;
-            node = getNN(tableIndex);
-            en = getEN(tableIndex);
-            if ((node == nodeNumber) && (en == eventNumber)) {
-                return tableIndex;
-            }
+    for (chainIdx=0; chainIdx<numOverflow; chainIdx++) {
+        tableIndex = eventOverflow[chainIdx];
+        if ((eventOverflowPrints[chainIdx] == fingerprint) && matchEvent(tableIndex, nodeNumber, eventNumber)) {
+            return tableIndex;
         }
     }
+    if ( ! hashIncomplete) {
+        return NO_INDEX;
+    }
+    // not all events are in the index so fall back to searching the table
 #endif
+    for (tableIndex = findNextInMap(validStarts, 0); 
+            tableIndex < NUM_EVENTS; 
+            tableIndex = findNextInMap(validStarts, tableIndex+1)) {
+        if (matchEvent(tableIndex, nodeNumber, eventNumber)) {
+            return tableIndex;
+        }
+    }
     return NO_INDEX;
 }
 
@@ -857,14 +1234,19 @@ uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber) {
 uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
     EventTableFlags f;
     uint8_t startIndex = tableIndex;
+    uint8_t rowWidth = EVENT_TABLE_WIDTH;
+    uint8_t evOffset = EVENTTABLE_OFFSET_EVS;
+    
     if (evNum >= PARAM_NUM_EV_EVENT) {
         return CMDERR_INV_EV_IDX;
     }
-    while (evNum >= EVENT_TABLE_WIDTH) {
+    while (evNum >= rowWidth) {
         uint8_t nextIdx;
         
         // skip forward looking for the right chained table entry
-        evNum -= EVENT_TABLE_WIDTH;
+        evNum -= rowWidth;
+        rowWidth = EVENTTABLE_MORE_WIDTH;
+        evOffset = EVENTTABLE_OFFSET_MORE_EVS;
         f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
         
         if (f.continued) {
@@ -882,43 +1264,42 @@ uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
             if (evVal == EV_FILL) {
                 return 0;
             }
-            // find the next free entry
-            for (nextIdx = tableIndex+1 ; nextIdx < NUM_EVENTS; nextIdx++) {
-                EventTableFlags nextF;
-                nextF.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_FLAGS);
-                if (nextF.freeEntry) {
-                    uint8_t e;
-                     // found a free slot, initialise it
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_NN, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_NN+1, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EN, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EN+1, 0xff); // this field not used
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_FLAGS, 0x20);    // set continuation flag, clear free and numEV to 0
-                    for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
-                        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EVS+e, EV_FILL); // clear the EVs
-                    }
-                    // set the next of the previous in chain
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT, nextIdx);
-                    // set the continued flag
-                    f.continued = 1;
-                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, f.asByte);
-                    tableIndex = nextIdx;
-                    break;
-                }
+            // find the next free entry, preferably following this one
+            nextIdx = findNextInMap(freeSlots, tableIndex+1);
+            if (nextIdx >= NUM_EVENTS) {
+                // the chain can go backwards, compaction will tidy it up later
+                nextIdx = findNextInMap(freeSlots, 0);
             }
             if (nextIdx >= NUM_EVENTS) {
                 // ran out of table entries
                 return CMDERR_TOO_MANY_EVENTS;
+            } else {
+                uint8_t e;
+                // found a free slot, initialise it
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_NN, 0xff); // this field not used, or EV_FILL if compact
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_NN+1, 0xff); // this field not used, or EV_FILL if compact
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EN, 0xff); // this field not used, or EV_FILL if compact
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EN+1, 0xff); // this field not used, or EV_FILL if compact
+                writeFlags(nextIdx, 0x20);    // set continuation flag, clear free and numEV to 0
+                for (e = 0; e < EVENT_TABLE_WIDTH; e++) {
+                    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*nextIdx+EVENTTABLE_OFFSET_EVS+e, EV_FILL); // clear the EVs
+                }
+                // set the next of the previous in chain
+                writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT, nextIdx);
+                // set the continued flag
+                f.continued = 1;
+                writeFlags(tableIndex, f.asByte);
+                tableIndex = nextIdx;
             }
         } 
     }
     // now write the EV
-    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evNum, evVal);
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+evOffset+evNum, evVal);
     // update the number per row count
     f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
     if (f.eVsUsed <= evNum) {
         f.eVsUsed = evNum+1U;
-        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, f.asByte);
+        writeFlags(tableIndex, f.asByte);
     }
     // If we are deleting then see if we can remove all
     if (evVal == EV_FILL) {
@@ -936,6 +1317,9 @@ uint8_t writeEv(uint8_t tableIndex, uint8_t evNum, uint8_t evVal) {
  */
 int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
     EventTableFlags f;
+    uint8_t rowWidth = EVENT_TABLE_WIDTH;
+    uint8_t evOffset = EVENTTABLE_OFFSET_EVS;
+    
     if ( ! validStart(tableIndex)) {
         // not a valid start
         return -CMDERR_INVALID_EVENT;
@@ -944,8 +1328,8 @@ int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
         return -CMDERR_INV_EV_IDX;
     }
     f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-    while (evNum >= EVENT_TABLE_WIDTH) {
-        // if evNum is beyond current EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_ entry move to next one
+    while (evNum >= rowWidth) {
+        // if evNum is beyond current entry move to next one
         if (! f.continued) {
             return -CMDERR_NO_EV;
         }
@@ -954,13 +1338,15 @@ int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
             return -CMDERR_INVALID_EVENT;
         }
         f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-        evNum -= EVENT_TABLE_WIDTH;
+        evNum -= rowWidth;
+        rowWidth = EVENTTABLE_MORE_WIDTH;
+        evOffset = EVENTTABLE_OFFSET_MORE_EVS;
     }
     if (evNum+1 > f.eVsUsed) {
         return -CMDERR_NO_EV;
     }
     // it is within this entry
-    return (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evNum);
+    return (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+evOffset+evNum);
 }
 
 /**
@@ -972,6 +1358,8 @@ int16_t getEv(uint8_t tableIndex, uint8_t evNum) {
 uint8_t numEv(uint8_t tableIndex) {
     EventTableFlags f;
     uint8_t num=0;
+    uint8_t rowWidth = EVENT_TABLE_WIDTH;
+    
     if ( ! validStart(tableIndex)) {
         // not a valid start
         return 0;
@@ -983,7 +1371,8 @@ uint8_t numEv(uint8_t tableIndex) {
             return 0;
         }
         f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-        num += EVENT_TABLE_WIDTH;
+        num += rowWidth;
+        rowWidth = EVENTTABLE_MORE_WIDTH;
     }
     num += f.eVsUsed;
     return num;
@@ -997,8 +1386,10 @@ uint8_t numEv(uint8_t tableIndex) {
  */
 uint8_t evs[PARAM_NUM_EV_EVENT];
 uint8_t getEVs(uint8_t tableIndex) {
-    EventTableFlags f;
+    EventTable row;
     uint8_t evNum;
+    uint8_t rowWidth = EVENT_TABLE_WIDTH;
+    uint8_t evOffset = EVENTTABLE_OFFSET_EVS;
     
     if ( ! validStart(tableIndex)) {
         // not a valid start
@@ -1006,18 +1397,20 @@ uint8_t getEVs(uint8_t tableIndex) {
     }
     for (evNum=0; evNum < PARAM_NUM_EV_EVENT; ) {
         uint8_t evIdx;
-        for (evIdx=0; evIdx < EVENT_TABLE_WIDTH; evIdx++) {
-            evs[evNum] = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_EVS+evIdx);
+        readEventRow(tableIndex, &row);
+        for (evIdx=0; (evIdx < rowWidth) && (evNum < PARAM_NUM_EV_EVENT); evIdx++) {
+            evs[evNum] = ((uint8_t *)&row)[evOffset+evIdx];
             evNum++;
         }
-        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-        if (! f.continued) {
+        rowWidth = EVENTTABLE_MORE_WIDTH;
+        evOffset = EVENTTABLE_OFFSET_MORE_EVS;
+        if (! row.flags.continued) {
             for (; evNum < PARAM_NUM_EV_EVENT; evNum++) {
                 evs[evNum] = EV_FILL;
             }
             return 0;
         }
-        tableIndex = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+        tableIndex = row.next;
         if (tableIndex == NO_INDEX) {
             return CMDERR_INVALID_EVENT;
         }
@@ -1062,6 +1455,54 @@ uint16_t getEN(uint8_t tableIndex) {
     return lo | (hi << 8);
 }
 
+/**
+ * Return the NN and EN for an event using a single read of the event table 
+ * rather than calling both getNN() and getEN().
+ * 
+ * @param tableIndex the index of the start of an event
+ * @param event where the NN and EN are to be put
+ */
+void getEvent(uint8_t tableIndex, Event * event) {
+    struct {
+        EventTableFlags flags;
+        uint8_t next;
+        Event event;
+    } header;
+    
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex, (uint8_t *)&header, sizeof(header));
+    if (header.flags.forceOwnNN) {
+        header.event.NN = nn.word;
+    }
+    *event = header.event;
+}
+
+/**
+ * Confirm that the event at an index in the event table has the NN/EN specified.
+ * 
+ * @param tableIndex the index of the start of an event
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @return 1 if the event matches
+ */
+static uint8_t matchEvent(uint8_t tableIndex, uint16_t nodeNumber, uint16_t eventNumber) {
+    Event event;
+    
+    getEvent(tableIndex, &event);
+    return (event.EN == eventNumber) && (event.NN == nodeNumber);
+}
+
+/**
+ * Read a whole row of the event table using a single read of the NVM.
+ * Getter so that the application code can decode an event without a call to 
+ * getEv() for each EV. The forceOwnNN flag is not applied to the NN.
+ * 
+ * @param tableIndex the index of the row
+ * @param row where the row is to be put
+ */
+void readEventRow(uint8_t tableIndex, EventTable * row) {
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex, (uint8_t *)row, sizeof(EventTable));
+}
+
 /**
  * Convert an evtIdx from CBUS to an index into the EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_.
  * The CBUS spec uses "EN#" as an index into an "Event Table". This is very implementation
@@ -1118,111 +1559,935 @@ static void checkRemoveTableEntry(uint8_t tableIndex) {
  * @return true if the specified index is the start of a linked set
  */
 Boolean validStart(uint8_t tableIndex) {
-    EventTableFlags f;
 #ifdef SAFETY
     if (tableIndex >= NUM_EVENTS) return FALSE;
 #endif
-    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
-    if (( !f.freeEntry) && ( ! f.continuation)) {
+    if (validStarts[tableIndex >> 3] & (1 << (tableIndex & 7))) {
         return TRUE;
     } else {
         return FALSE;
     }
 }
 
-#ifdef EVENT_HASH_TABLE
 /**
- * Obtain a hash for the specified Event. 
- * 
- * The hash table uses an algorithm of an XOR of all the bytes with appropriate shifts.
+ * Cursor to find the next entry in the event table, at or after the one 
+ * specified, which is the start of an event.
  * 
- * If we used just the node number, then all short events would hash to the same number
- * If we used just the event number, then for long events the vast majority would 
- * be 1 to 8, so not giving a very good spread.
- *
- * This algorithm hopefully produces a good spread for layouts with either
- * predominantly short events, long events or a mixture.
- * This also means that for layouts using the default FLiM node numbers from 256, 
- * we are effectively starting from zero as far as the hash algorithm is concerned.
+ * @param tableIndex the index into event table to start searching from
+ * @return the index of the next event or NUM_EVENTS if there are no more
+ */
+uint8_t nextValidStart(uint8_t tableIndex) {
+    return findNextInMap(validStarts, tableIndex);
+}
+
+/**
+ * Write the flags of an event table row and update the RAM occupancy maps to 
+ * match. All changes to the flags must be made using this function.
  * 
- * @param e the event
- * @return the hash
+ * @param tableIndex the index into event table
+ * @param flags the new flags
  */
-uint8_t getHash(uint16_t nn, uint16_t en) {
-    uint8_t hash;
-    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
-    hash = (uint8_t)(nn ^ (nn >> 8U));
-    hash = (uint8_t)(7U*hash + (en ^ (en>>8U))); 
-    // ensure it is within bounds of eventChains
-    hash %= EVENT_HASH_LENGTH;
-    return hash;
+static void writeFlags(uint8_t tableIndex, uint8_t flags) {
+    writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS, flags);
+    setOccupancy(tableIndex, flags);
 }
- 
+
 /**
- * Initialise the RAM hash chain for reverse lookup of event to action. Uses the
- * data from the Flash Event2Action table.
+ * Update the RAM occupancy maps for the flags which have been written to a row.
+ * 
+ * @param tableIndex the index into event table
+ * @param flags the flags written
  */
-void rebuildHashtable(void) {
-    // invalidate the current hash table
-    unsigned char hash;
-    unsigned char chainIdx;
-    unsigned char tableIndex;
-    int a;
-#ifdef PRODUCED_EVENTS
-    // first initialise to nothing
-    Happening happening;
-    for (happening=0; happening<=MAX_HAPPENING; happening++) {
-        happening2Event[happening] = NO_INDEX;
-    }
+static void setOccupancy(uint8_t tableIndex, uint8_t flags) {
+    EventTableFlags f;
+    uint8_t mask;
+    uint8_t i;
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    uint8_t wasStart;
 #endif
-#ifdef CONSUMED_EVENTS
-    for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
-        for (chainIdx=0; chainIdx < EVENT_CHAIN_LENGTH; chainIdx++) {
-            eventChains[hash][chainIdx] = NO_INDEX;
+    
+    f.asByte = flags;
+    i = tableIndex >> 3;
+    mask = (uint8_t)(1 << (tableIndex & 7));
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    wasStart = validStarts[i] & mask;
+#endif
+    if (f.freeEntry) {
+        freeSlots[i] |= mask;
+        validStarts[i] &= ~mask;
+    } else {
+        freeSlots[i] &= ~mask;
+        if (f.continuation) {
+            validStarts[i] &= ~mask;
+        } else {
+            validStarts[i] |= mask;
         }
     }
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    // adding or removing an event means the perfect hash no longer applies
+    if ((validStarts[i] & mask) != wasStart) {
+        fixedHashInvalidate();
+    }
 #endif
-    // now scan the event2Action table and populate the hash and lookup tables
+}
+
+/**
+ * Build the RAM occupancy maps from the flags in the event table.
+ */
+static void rebuildOccupancy(void) {
+    EventTableFlags f;
+    uint8_t tableIndex;
+    uint8_t mask;
     
+    for (tableIndex=0; tableIndex<OCCUPANCY_MAP_SIZE; tableIndex++) {
+        freeSlots[tableIndex] = 0;
+        validStarts[tableIndex] = 0;
+    }
     for (tableIndex=0; tableIndex<NUM_EVENTS; tableIndex++) {
-        if (validStart(tableIndex)) {
-            int16_t ev;
+        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+        mask = (uint8_t)(1 << (tableIndex & 7));
+        if (f.freeEntry) {
+            freeSlots[tableIndex >> 3] |= mask;
+        } else if ( ! f.continuation) {
+            validStarts[tableIndex >> 3] |= mask;
+        }
+    }
+}
+
+/**
+ * Find the first row, at or after the one specified, whose bit is set in an
+ * occupancy map. Whole bytes of clear bits are skipped at once.
+ * 
+ * @param map either freeSlots or validStarts
+ * @param tableIndex the index into event table to start searching from
+ * @return the index of the row found or NUM_EVENTS if there are none
+ */
+static uint8_t findNextInMap(uint8_t * map, uint8_t tableIndex) {
+    uint8_t bits;
     
-            // found the start of an event definition
+    while (tableIndex < NUM_EVENTS) {
+        bits = (uint8_t)(map[tableIndex >> 3] >> (tableIndex & 7));
+        if (bits == 0) {
+            // nothing else in this byte so move to the start of the next one
+            tableIndex |= 7;
+            if (tableIndex >= NUM_EVENTS) break;
+            tableIndex++;
+            continue;
+        }
+        while ( ! (bits & 1)) {
+            bits >>= 1;
+            tableIndex++;
+        }
+        return tableIndex;
+    }
+    return NUM_EVENTS;
+}
+
+/**
+ * Count the number of rows whose bit is set in an occupancy map.
+ * 
+ * @param map either freeSlots or validStarts
+ * @return the number of bits set
+ */
+static uint8_t countMap(uint8_t * map) {
+    uint8_t count = 0;
+    uint8_t i;
+    uint8_t bits;
+    
+    for (i=0; i<OCCUPANCY_MAP_SIZE; i++) {
+        for (bits = map[i]; bits != 0; bits &= (uint8_t)(bits-1)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Compact the event table so that each event's rows are contiguous and the
+ * free rows are all at the end of the table. The RAM occupancy maps and hash
+ * tables are updated as rows are moved.
+ * Changes the EN# index of events.
+ */
+void defragEventTable(void) {
+    defragCursor = 0;
+    while (defragStep())
+        ;
+    defragWanted = FALSE;
+}
+
+/**
+ * Perform a single step of the compaction. The next event after defragCursor is
+ * moved to defragCursor and its chained rows are moved to follow it.
+ * 
+ * @return TRUE if there may be more to do, FALSE if compaction is complete
+ */
+static Boolean defragStep(void) {
+    uint8_t tableIndex;
+    uint8_t next;
+    EventTableFlags f;
+    
+    if (defragCursor < NUM_EVENTS) {
+        tableIndex = nextValidStart(defragCursor);
+    } else {
+        tableIndex = NUM_EVENTS;
+    }
+    if (tableIndex >= NUM_EVENTS) {
+        // everything from the cursor onwards is free
+        defragCursor = NUM_EVENTS;
+        if (defragMoved) {
+            teachDiagnostics[TEACH_DIAGNOSTICS_DEFRAGS].asUint++;
+            defragMoved = FALSE;
+        }
+        return FALSE;
+    }
+    if (tableIndex != defragCursor) {
+        swapRows(tableIndex, NO_INDEX, defragCursor);
+    }
+    // now bring the chained rows alongside
+    tableIndex = defragCursor;
+    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    while (f.continued) {
+        next = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_NEXT);
+        if ((next >= NUM_EVENTS) || (next <= tableIndex)) {
+            // broken chain, leave it alone
+            break;
+        }
+        if (next != tableIndex+1) {
+            swapRows(next, tableIndex, tableIndex+1);
+        }
+        tableIndex++;
+        f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    }
+    defragCursor = tableIndex+1;
+    clearJournal();
+    return TRUE;
+}
+
+/**
+ * Exchange two rows of the event table, updating the next field of any rows
+ * which chain to them along with the RAM occupancy maps and hash tables.
+ * Both new rows are staged in the journal, which is written to NVM first, and
+ * then each row is written whole so that a reset part way through can be
+ * recovered by recoverJournal().
+ * 
+ * @param a index of a row
+ * @param preA the row which chains to a, or NO_INDEX if a is not a continuation
+ * @param b index of another row
+ */
+static void swapRows(uint8_t a, uint8_t preA, uint8_t b) {
+    uint8_t preB;
+    uint8_t i;
+    uint16_t check;
+    
+    defragMoved = TRUE;
+    eventTableChanged = EVENT_TABLE_CHANGED_ALL;
+#ifdef EVENT_FIXED_HASH_ADDRESS
+    fixedHashInvalidate();
+#endif
+    preB = findPredecessor(b);
+    journal[DEFRAG_JOURNAL_OFFSET_A] = a;
+    journal[DEFRAG_JOURNAL_OFFSET_B] = b;
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*b, journal+DEFRAG_JOURNAL_OFFSET_ROW_A, EVENTTABLE_ROW_WIDTH);
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*a, journal+DEFRAG_JOURNAL_OFFSET_ROW_B, EVENTTABLE_ROW_WIDTH);
+    // the rows which chained to a and b must chain to where they have moved,
+    // which may be one of the swapped rows itself
+    journal[DEFRAG_JOURNAL_OFFSET_PRE_A] = NO_INDEX;
+    journal[DEFRAG_JOURNAL_OFFSET_PRE_B] = NO_INDEX;
+    if (preA == b) {
+        journal[DEFRAG_JOURNAL_OFFSET_ROW_A+EVENTTABLE_OFFSET_NEXT] = b;
+    } else if (preA != NO_INDEX) {
+        journal[DEFRAG_JOURNAL_OFFSET_PRE_A] = preA;
+        journal[DEFRAG_JOURNAL_OFFSET_NEXT_A] = b;
+    }
+    if (preB == a) {
+        journal[DEFRAG_JOURNAL_OFFSET_ROW_B+EVENTTABLE_OFFSET_NEXT] = a;
+    } else if (preB != NO_INDEX) {
+        journal[DEFRAG_JOURNAL_OFFSET_PRE_B] = preB;
+        journal[DEFRAG_JOURNAL_OFFSET_NEXT_B] = a;
+    }
+    journal[DEFRAG_JOURNAL_OFFSET_MARKER] = DEFRAG_JOURNAL_PENDING;
+    check = journalCheck();
+    journal[DEFRAG_JOURNAL_OFFSET_CHECK] = (uint8_t)check;
+    journal[DEFRAG_JOURNAL_OFFSET_CHECK+1] = (uint8_t)(check >> 8);
+    for (i=0; i<DEFRAG_JOURNAL_SIZE; i++) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_DEFRAG_JOURNAL_ADDRESS+i, journal[i]);
+    }
+    // the journal must be in NVM before any row is changed
+    flushFlashBlock();
+    applyJournal();
+    flushFlashBlock();
+    defragJournalled = TRUE;
+#ifdef EVENT_HASH_TABLE
+    hashSwap(a, b);
+#endif
+}
+
+/**
+ * Find the row which chains to the specified continuation row. Only the events
+ * from defragCursor onwards are searched as those before it have already been
+ * compacted and so only chain to rows before defragCursor.
+ * 
+ * @param tableIndex index of a row
+ * @return the index of the row whose next is tableIndex or NO_INDEX if none
+ */
+static uint8_t findPredecessor(uint8_t tableIndex) {
+    EventTableFlags f;
+    uint8_t start;
+    uint8_t i;
+    uint8_t next;
+    uint8_t hops;
+    
+    f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*tableIndex+EVENTTABLE_OFFSET_FLAGS);
+    if (f.freeEntry || ( ! f.continuation)) {
+        return NO_INDEX;
+    }
+    for (start = findNextInMap(validStarts, defragCursor);
+            start < NUM_EVENTS;
+            start = findNextInMap(validStarts, start+1)) {
+        // follow the event's chain
+        i = start;
+        for (hops=0; hops<NUM_EVENTS; hops++) {
+            f.asByte = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_FLAGS);
+            if ( ! f.continued) break;
+            next = (uint8_t)readNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*i+EVENTTABLE_OFFSET_NEXT);
+            if (next == tableIndex) {
+                return i;
+            }
+            if (next >= NUM_EVENTS) break;
+            i = next;
+        }
+    }
+    return NO_INDEX;
+}
+
+/**
+ * Calculate the check of the journal, a Fletcher-16 of everything before it.
+ * 
+ * @return the check
+ */
+static uint16_t journalCheck(void) {
+    uint8_t sum1 = 0;
+    uint8_t sum2 = 0;
+    uint8_t i;
+    
+    for (i=0; i<DEFRAG_JOURNAL_OFFSET_CHECK; i++) {
+        sum1 += journal[i];
+        sum2 += sum1;
+    }
+    return ((uint16_t)sum2 << 8) | sum1;
+}
+
+/**
+ * Write the rows of the swap held in the journal to the event table and
+ * update the RAM occupancy maps. Writes row a completely, then row b, then the
+ * rows which chain to them. Writing them again has no further effect.
+ */
+static void applyJournal(void) {
+    uint8_t a;
+    uint8_t b;
+    uint8_t i;
+    
+    a = journal[DEFRAG_JOURNAL_OFFSET_A];
+    b = journal[DEFRAG_JOURNAL_OFFSET_B];
+    for (i=0; i<EVENTTABLE_ROW_WIDTH; i++) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*a+i, journal[DEFRAG_JOURNAL_OFFSET_ROW_A+i]);
+    }
+    for (i=0; i<EVENTTABLE_ROW_WIDTH; i++) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*b+i, journal[DEFRAG_JOURNAL_OFFSET_ROW_B+i]);
+    }
+    if (journal[DEFRAG_JOURNAL_OFFSET_PRE_A] < NUM_EVENTS) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*journal[DEFRAG_JOURNAL_OFFSET_PRE_A]+EVENTTABLE_OFFSET_NEXT, journal[DEFRAG_JOURNAL_OFFSET_NEXT_A]);
+    }
+    if (journal[DEFRAG_JOURNAL_OFFSET_PRE_B] < NUM_EVENTS) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + EVENTTABLE_ROW_WIDTH*journal[DEFRAG_JOURNAL_OFFSET_PRE_B]+EVENTTABLE_OFFSET_NEXT, journal[DEFRAG_JOURNAL_OFFSET_NEXT_B]);
+    }
+    setOccupancy(a, journal[DEFRAG_JOURNAL_OFFSET_ROW_A+EVENTTABLE_OFFSET_FLAGS]);
+    setOccupancy(b, journal[DEFRAG_JOURNAL_OFFSET_ROW_B+EVENTTABLE_OFFSET_FLAGS]);
+}
+
+/**
+ * Complete a swap of rows which was interrupted by a reset. If the journal was
+ * only partly written its check fails and the rows were not changed.
+ */
+static void recoverJournal(void) {
+    uint16_t check;
+    
+    readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENT_DEFRAG_JOURNAL_ADDRESS, journal, DEFRAG_JOURNAL_SIZE);
+    if (journal[DEFRAG_JOURNAL_OFFSET_MARKER] != DEFRAG_JOURNAL_PENDING) {
+        return;
+    }
+    check = journalCheck();
+    if ((journal[DEFRAG_JOURNAL_OFFSET_CHECK] == (uint8_t)check)
+            && (journal[DEFRAG_JOURNAL_OFFSET_CHECK+1] == (uint8_t)(check >> 8))
+            && (journal[DEFRAG_JOURNAL_OFFSET_A] < NUM_EVENTS)
+            && (journal[DEFRAG_JOURNAL_OFFSET_B] < NUM_EVENTS)) {
+        applyJournal();
+    }
+    defragJournalled = TRUE;
+    clearJournal();
+}
+
+/**
+ * Mark the swap in the journal as complete once its rows are in NVM.
+ */
+static void clearJournal(void) {
+    if (defragJournalled) {
+        writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_DEFRAG_JOURNAL_ADDRESS+DEFRAG_JOURNAL_OFFSET_MARKER, DEFRAG_JOURNAL_DONE);
+        flushFlashBlock();
+        defragJournalled = FALSE;
+    }
+}
+
+#ifdef EVENT_FIXED_HASH_ADDRESS
+/**
+ * The hash function used for the perfect hash. Each seed gives a different
+ * hash of the event. Seed 0 is used to allocate events to buckets.
+ * 
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @param seed the seed
+ * @return the hash
+ */
+static uint16_t fixedHash(uint16_t nodeNumber, uint16_t eventNumber, uint8_t seed) {
+    uint16_t hash;
+    
+    hash = 0x811C ^ seed;
+    hash = (hash ^ (eventNumber & 0xFF)) * 0x0193;
+    hash = (hash ^ (eventNumber >> 8)) * 0x0193;
+    hash = (hash ^ (nodeNumber & 0xFF)) * 0x0193;
+    hash = (hash ^ (nodeNumber >> 8)) * 0x0193;
+    // mix in the seed again so that each seed spreads the events differently
+    hash = (hash ^ seed) * 0x0193;
+    return hash ^ (hash >> 7);
+}
+
+/**
+ * Scale a hash to the range 0..n-1 using a multiply rather than a divide.
+ * 
+ * @param hash the hash
+ * @param n the size of the range
+ * @return the scaled hash
+ */
+static uint8_t fixedHashScale(uint16_t hash, uint8_t n) {
+    return (uint8_t)(((uint24_t)hash * n) >> 16);
+}
+
+/**
+ * Find an event using the perfect hash. Must only be called when the perfect
+ * hash is valid.
+ * 
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @return the index of the event or NO_INDEX
+ */
+static uint8_t fixedHashFind(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t bucket;
+    uint8_t seed;
+    uint8_t slot;
+    uint8_t tableIndex;
+    
+    if (fixedHashKeys == 0) {
+        return NO_INDEX;
+    }
+    bucket = fixedHashScale(fixedHash(nodeNumber, eventNumber, 0), fixedHashBuckets);
+    seed = (uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SEEDS+bucket);
+    if ((uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_DIRECT+(bucket>>3)) & (1 << (bucket & 7))) {
+        // bucket with a single event holds its slot directly
+        slot = seed;
+    } else {
+        slot = fixedHashScale(fixedHash(nodeNumber, eventNumber, seed), fixedHashKeys);
+    }
+    tableIndex = (uint8_t)readNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SLOTS+slot);
+    // a slot of a removed event is never reported as found
+    if ((tableIndex < NUM_EVENTS) && validStart(tableIndex) && matchEvent(tableIndex, nodeNumber, eventNumber)) {
+        return tableIndex;
+    }
+    return NO_INDEX;
+}
+
+/**
+ * Check that the perfect hash in flash finds every event in the event table.
+ * 
+ * @return TRUE if all the events are found at their own index
+ */
+static Boolean fixedHashCheck(void) {
+    uint8_t tableIndex;
+    Event event;
+    
+    for (tableIndex = findNextInMap(validStarts, 0); 
+            tableIndex < NUM_EVENTS; 
+            tableIndex = findNextInMap(validStarts, tableIndex+1)) {
+        getEvent(tableIndex, &event);
+        if (fixedHashFind(event.NN, event.EN) != tableIndex) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * Mark the perfect hash as no longer covering the events. Outside of a teach 
+ * transaction the marker is written to flash straight away, otherwise it is 
+ * written along with the other pending changes. If a reset leaves the hash
+ * marked as valid then fixedHashCheck() finds it out of date at power up.
+ */
+static void fixedHashInvalidate(void) {
+    if (fixedHashValid) {
+        fixedHashValid = FALSE;
+        writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_MARKER, 0);
+        if (teachTransaction == TEACH_TRANSACTION_NONE) {
+            flushFlashBlock();
+        } else {
+            teachPending = TRUE;
+        }
+    }
+}
+
+/**
+ * Build a minimal perfect hash of the events currently in the event table and
+ * store it in flash. Events are allocated to buckets, on average 1 event per 
+ * bucket. A seed
+ * is found for each bucket, largest first, which puts its events into unused
+ * slots. Buckets with a single event then take the remaining slots directly.
+ * Called at power up if the events have changed and may also be called by the 
+ * application, for example after setting up the default events.
+ * 
+ * @return TRUE if the perfect hash was built, FALSE if findEvent() will carry on
+ * using the dynamic index
+ */
+Boolean buildFixedEventHash(void) {
+    // static as they are too big for the compiled stack
+    static uint8_t counts[FIXED_HASH_MAX_BUCKETS];
+    static uint8_t direct[(FIXED_HASH_MAX_BUCKETS+7)/8];
+    static uint8_t used[OCCUPANCY_MAP_SIZE];
+    static Event keys[FIXED_HASH_MAX_BUCKET_SIZE];
+    static uint8_t keyIndexes[FIXED_HASH_MAX_BUCKET_SIZE];
+    static uint8_t slots[FIXED_HASH_MAX_BUCKET_SIZE];
+    uint8_t numKeys;
+    uint8_t numBuckets;
+    uint8_t bucket;
+    uint8_t size;
+    uint8_t seed;
+    uint8_t n;
+    uint8_t i;
+    uint8_t j;
+    uint8_t tableIndex;
+    uint8_t freeSlot;
+    Event event;
+    
+    fixedHashInvalidate();
+    numKeys = countMap(validStarts);
+    numBuckets = numKeys;
+    if (numBuckets == 0) {
+        numBuckets = 1;
+    }
+    for (i=0; i<FIXED_HASH_MAX_BUCKETS; i++) {
+        counts[i] = 0;
+    }
+    for (i=0; i<sizeof(direct); i++) {
+        direct[i] = 0;
+    }
+    for (i=0; i<OCCUPANCY_MAP_SIZE; i++) {
+        used[i] = 0;
+    }
+    // count the events in each bucket
+    for (tableIndex = findNextInMap(validStarts, 0); 
+            tableIndex < NUM_EVENTS; 
+            tableIndex = findNextInMap(validStarts, tableIndex+1)) {
+        getEvent(tableIndex, &event);
+        bucket = fixedHashScale(fixedHash(event.NN, event.EN, 0), numBuckets);
+        if (counts[bucket] >= FIXED_HASH_MAX_BUCKET_SIZE) {
+            return FALSE;
+        }
+        counts[bucket]++;
+    }
+    // place the buckets with more than one event, largest first
+    for (size = FIXED_HASH_MAX_BUCKET_SIZE; size >= 2; size--) {
+        for (bucket=0; bucket<numBuckets; bucket++) {
+            if (counts[bucket] != size) continue;
+            n = 0;
+            for (tableIndex = findNextInMap(validStarts, 0); 
+                    tableIndex < NUM_EVENTS; 
+                    tableIndex = findNextInMap(validStarts, tableIndex+1)) {
+                getEvent(tableIndex, &event);
+                if (fixedHashScale(fixedHash(event.NN, event.EN, 0), numBuckets) == bucket) {
+                    keys[n] = event;
+                    keyIndexes[n] = tableIndex;
+                    n++;
+                }
+            }
+            for (seed=1; seed != 0; seed++) {
+                for (i=0; i<n; i++) {
+                    slots[i] = fixedHashScale(fixedHash(keys[i].NN, keys[i].EN, seed), numKeys);
+                    if (used[slots[i]>>3] & (1 << (slots[i] & 7))) break;
+                    for (j=0; j<i; j++) {
+                        if (slots[j] == slots[i]) break;
+                    }
+                    if (j < i) break;
+                }
+                if (i == n) break;
+            }
+            if (seed == 0) {
+                // no seed found so carry on with the dynamic index
+                return FALSE;
+            }
+            writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SEEDS+bucket, seed);
+            for (i=0; i<n; i++) {
+                used[slots[i]>>3] |= (1 << (slots[i] & 7));
+                writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SLOTS+slots[i], keyIndexes[i]);
+            }
+            counts[bucket] = 0xFF;
+        }
+    }
+    // the events on their own in a bucket fill the remaining slots
+    freeSlot = 0;
+    for (tableIndex = findNextInMap(validStarts, 0); 
+            tableIndex < NUM_EVENTS; 
+            tableIndex = findNextInMap(validStarts, tableIndex+1)) {
+        getEvent(tableIndex, &event);
+        bucket = fixedHashScale(fixedHash(event.NN, event.EN, 0), numBuckets);
+        if (counts[bucket] != 1) continue;
+        while (used[freeSlot>>3] & (1 << (freeSlot & 7))) {
+            freeSlot++;
+        }
+        used[freeSlot>>3] |= (1 << (freeSlot & 7));
+        direct[bucket>>3] |= (1 << (bucket & 7));
+        writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SEEDS+bucket, freeSlot);
+        writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SLOTS+freeSlot, tableIndex);
+    }
+    // empty buckets point at any slot, the compare of the event will fail
+    for (bucket=0; bucket<numBuckets; bucket++) {
+        if (counts[bucket] == 0) {
+            direct[bucket>>3] |= (1 << (bucket & 7));
+            writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_SEEDS+bucket, 0);
+        }
+    }
+    for (i=0; i<sizeof(direct); i++) {
+        writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_DIRECT+i, direct[i]);
+    }
+    writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_KEYS, numKeys);
+    writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_BUCKETS, numBuckets);
+    writeNVM(FLASH_NVM_TYPE, EVENT_FIXED_HASH_ADDRESS+FIXED_HASH_OFFSET_MARKER, FIXED_HASH_VALID);
+    flushFlashBlock();
+    fixedHashKeys = numKeys;
+    fixedHashBuckets = numBuckets;
+    fixedHashValid = TRUE;
+    return TRUE;
+}
+#endif
+
+#ifdef EVENT_HASH_TABLE
+/**
+ * Obtain a hash for the specified Event. 
+ * 
+ * The hash table uses an algorithm of an XOR of all the bytes with appropriate shifts.
+ * 
+ * If we used just the node number, then all short events would hash to the same number
+ * If we used just the event number, then for long events the vast majority would 
+ * be 1 to 8, so not giving a very good spread.
+ *
+ * This algorithm hopefully produces a good spread for layouts with either
+ * predominantly short events, long events or a mixture.
+ * This also means that for layouts using the default FLiM node numbers from 256, 
+ * we are effectively starting from zero as far as the hash algorithm is concerned.
+ * 
+ * @param e the event
+ * @return the hash
+ */
+uint8_t getHash(uint16_t nn, uint16_t en) {
+    uint8_t hash;
+    // need to hash the NN and EN to a uniform distribution across HASH_LENGTH
+    hash = (uint8_t)(nn ^ (nn >> 8U));
+    hash = (uint8_t)(7U*hash + (en ^ (en>>8U))); 
+    // ensure it is within bounds of eventChains
+    hash %= EVENT_HASH_LENGTH;
+    return hash;
+}
+ 
+/**
+ * Initialise the RAM hash chain for reverse lookup of event to action. Uses the
+ * data from the Flash Event2Action table.
+ * Only needs to be done at power up or after the whole table has changed as
+ * individual changes are handled by hashInsert() and hashRemove().
+ */
+void rebuildHashtable(void) {
+    // invalidate the current hash table
+    uint8_t hash;
+    uint8_t chainIdx;
+    uint8_t tableIndex;
 #ifdef PRODUCED_EVENTS
-            // ev[0] and ev[1] is used to store the Produced event's action
-#if HAPPENING_SIZE == 2
-            ev = getEv(tableIndex, 0);
-            if (ev < 0) continue;
-            happening.bytes.hi = (uint8_t) ev;
-            ev = getEv(tableIndex, 1);
-            if (ev < 0) continue;
-            happening.bytes.lo = (uint8_t) ev;
+    uint16_t happening;
+    // first initialise to nothing
+    for (happening=0; happening<=MAX_HAPPENING+1; happening++) {
+        happeningEventStart[happening] = 0;
+    }
 #endif
-#if HAPPENING_SIZE ==1
-            // ev[0] is used to store the Produced event's action
-            ev = getEv(tableIndex, 0);
-            if (ev < 0) continue;
-            happening = (uint8_t) ev;
+    for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
+        for (chainIdx=0; chainIdx < EVENT_CHAIN_LENGTH; chainIdx++) {
+            eventChains[hash][chainIdx] = NO_INDEX;
+        }
+    }
+    numOverflow = 0;
+    hashIncomplete = FALSE;
+    // now scan the event2Action table and populate the hash and lookup tables
+    for (tableIndex = nextValidStart(0); 
+            tableIndex < NUM_EVENTS; 
+            tableIndex = nextValidStart(tableIndex+1)) {
+        hashInsert(tableIndex);
+    }
+}
+
+/**
+ * Add an event to the hash chain for its NN/EN and to the Happening index for 
+ * its Happening. Does nothing if the event is already in its hash chain.
+ * 
+ * @param tableIndex the index of the start of an event
+ */
+static void hashInsert(uint8_t tableIndex) {
+    uint8_t hash;
+    uint8_t chainIdx;
+    uint8_t i;
+    uint8_t fingerprint;
+    uint16_t nodeNumber;
+    uint16_t eventNumber;
+    Event event;
+#ifdef PRODUCED_EVENTS
+    uint16_t happening;
+    
+    // ev[0] and ev[1] is used to store the Produced event's action
+    happening = getHappeningIndex(tableIndex);
+    if (happening <= MAX_HAPPENING) {
+        happeningInsert(happening, tableIndex);
+    }
 #endif
-            if (happening<= MAX_HAPPENING) {
-                happening2Event[happening] = tableIndex;
-            } 
+    // the hash chains are needed by findEvent() even without CONSUMED_EVENTS
+    getEvent(tableIndex, &event);
+    nodeNumber = event.NN;
+    eventNumber = event.EN;
+    hash = getHash(nodeNumber, eventNumber);
+    fingerprint = getFingerprint(nodeNumber, eventNumber);
+    // check whether it is already indexed
+    for (i=0; i<numOverflow; i++) {
+        if (eventOverflow[i] == tableIndex) {
+            return;
+        }
+    }
+    for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+        if (eventChains[hash][chainIdx] == tableIndex) {
+            return;
+        }
+        if (eventChains[hash][chainIdx] == NO_INDEX) {
+            // available
+            eventChains[hash][chainIdx] = tableIndex;
+            eventChainPrints[hash][chainIdx] = fingerprint;
+            return;
+        }
+    }
+    // chain is full so use the overflow list
+    if (numOverflow < EVENT_OVERFLOW_LENGTH) {
+        eventOverflow[numOverflow] = tableIndex;
+        eventOverflowPrints[numOverflow] = fingerprint;
+        numOverflow++;
+    } else {
+        // nowhere left so findEvent() must search the event table
+        hashIncomplete = TRUE;
+    }
+}
+
+/**
+ * Remove an event from the hash chains and from the Happening index. The event's
+ * flags may already have been cleared so its NN/EN and Happening are not used,
+ * instead the RAM tables are searched for the index.
+ * 
+ * @param tableIndex the index of the event being removed
+ */
+static void hashRemove(uint8_t tableIndex) {
+    uint8_t hash;
+    uint8_t chainIdx;
+#ifdef PRODUCED_EVENTS
+    happeningRemove(tableIndex);
 #endif
-#ifdef CONSUMED_EVENTS
-            hash = getHash(getNN(tableIndex), getEN(tableIndex));
-                
-            for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
-                if (eventChains[hash][chainIdx] == NO_INDEX) {
-                    // available
-                    eventChains[hash][chainIdx] = tableIndex;
-                    break;
+    for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
+        for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+            if (eventChains[hash][chainIdx] == NO_INDEX) {
+                break;
+            }
+            if (eventChains[hash][chainIdx] == tableIndex) {
+                // close the gap so that the chain has no holes
+                for (; chainIdx<EVENT_CHAIN_LENGTH-1; chainIdx++) {
+                    eventChains[hash][chainIdx] = eventChains[hash][chainIdx+1];
+                    eventChainPrints[hash][chainIdx] = eventChainPrints[hash][chainIdx+1];
                 }
+                eventChains[hash][EVENT_CHAIN_LENGTH-1] = NO_INDEX;
+                hashRemoved();
+                return;
             }
+        }
+    }
+    for (chainIdx=0; chainIdx<numOverflow; chainIdx++) {
+        if (eventOverflow[chainIdx] == tableIndex) {
+            // move the last one into the gap
+            numOverflow--;
+            eventOverflow[chainIdx] = eventOverflow[numOverflow];
+            eventOverflowPrints[chainIdx] = eventOverflowPrints[numOverflow];
+            hashRemoved();
+            return;
+        }
+    }
+}
+
+/**
+ * Called when space has been freed in the index. If some events could not be
+ * indexed then the index is rebuilt to try to include them.
+ */
+static void hashRemoved(void) {
+    if (hashIncomplete) {
+        rebuildHashtable();
+    }
+}
+
+/**
+ * Exchange two event table indexes within the RAM hash tables after the rows
+ * have been swapped.
+ * 
+ * @param a index of a row
+ * @param b index of another row
+ */
+static void hashSwap(uint8_t a, uint8_t b) {
+    uint8_t hash;
+    uint8_t chainIdx;
+#ifdef PRODUCED_EVENTS
+    uint8_t i;
+    
+    for (i=0; i<happeningEventStart[MAX_HAPPENING+1]; i++) {
+        if (happeningEvents[i] == a) {
+            happeningEvents[i] = b;
+        } else if (happeningEvents[i] == b) {
+            happeningEvents[i] = a;
+        }
+    }
 #endif
+    for (hash=0; hash<EVENT_HASH_LENGTH; hash++) {
+        for (chainIdx=0; chainIdx<EVENT_CHAIN_LENGTH; chainIdx++) {
+            if (eventChains[hash][chainIdx] == a) {
+                eventChains[hash][chainIdx] = b;
+            } else if (eventChains[hash][chainIdx] == b) {
+                eventChains[hash][chainIdx] = a;
+            }
+        }
+    }
+    for (chainIdx=0; chainIdx<numOverflow; chainIdx++) {
+        if (eventOverflow[chainIdx] == a) {
+            eventOverflow[chainIdx] = b;
+        } else if (eventOverflow[chainIdx] == b) {
+            eventOverflow[chainIdx] = a;
+        }
+    }
+}
+
+/**
+ * Obtain an 8 bit fingerprint of an event which is held in RAM beside the index 
+ * in the hash chains. This uses a different mix of the bytes to getHash() so 
+ * that events within the same chain are likely to have different fingerprints.
+ * 
+ * @param nodeNumber the event NN
+ * @param eventNumber the event EN
+ * @return the fingerprint
+ */
+static uint8_t getFingerprint(uint16_t nodeNumber, uint16_t eventNumber) {
+    uint8_t fingerprint;
+    fingerprint = (uint8_t)(eventNumber ^ (5U*(eventNumber >> 8U)));
+    fingerprint ^= (uint8_t)((3U*nodeNumber) ^ (nodeNumber >> 8U));
+    return fingerprint;
+}
+
+#ifdef PRODUCED_EVENTS
+/**
+ * Add an event to the list of events for a Happening, keeping the list in event
+ * table order. Does nothing if the event is already in the list.
+ * 
+ * @param happening the Happening
+ * @param tableIndex the index of the start of an event
+ */
+static void happeningInsert(uint16_t happening, uint8_t tableIndex) {
+    uint8_t pos;
+    uint8_t i;
+    
+    for (pos = happeningEventStart[happening]; pos < happeningEventStart[happening+1]; pos++) {
+        if (happeningEvents[pos] == tableIndex) {
+            return;
         }
+        if (happeningEvents[pos] > tableIndex) {
+            break;
+        }
+    }
+    // open a gap for it
+    for (i = happeningEventStart[MAX_HAPPENING+1]; i > pos; i--) {
+        happeningEvents[i] = happeningEvents[i-1];
+    }
+    happeningEvents[pos] = tableIndex;
+    for (happening++; happening<=MAX_HAPPENING+1; happening++) {
+        happeningEventStart[happening]++;
     }
 }
 
+/**
+ * Remove an event from the Happening index, whichever Happening it is listed 
+ * under.
+ * 
+ * @param tableIndex the index of the event
+ */
+static void happeningRemove(uint8_t tableIndex) {
+    uint8_t pos;
+    uint8_t end;
+    uint8_t i;
+    uint16_t happening;
+    
+    end = happeningEventStart[MAX_HAPPENING+1];
+    for (pos=0; pos<end; pos++) {
+        if (happeningEvents[pos] == tableIndex) {
+            break;
+        }
+    }
+    if (pos == end) {
+        return;
+    }
+    // close the gap
+    for (i=pos; i<end-1; i++) {
+        happeningEvents[i] = happeningEvents[i+1];
+    }
+    // the lists after the one it was in all move down by one
+    for (happening=0; happening<=MAX_HAPPENING+1; happening++) {
+        if (happeningEventStart[happening] > pos) {
+            happeningEventStart[happening]--;
+        }
+    }
+}
+
+/**
+ * Obtain the Happening stored in the first EVs of an event as an index into
+ * happeningEventStart.
+ * 
+ * @param tableIndex the index of the start of an event
+ * @return the Happening or 0xFFFF if the event doesn't have one
+ */
+static uint16_t getHappeningIndex(uint8_t tableIndex) {
+    int16_t ev;
+    uint16_t happening;
+    
+    ev = getEv(tableIndex, 0);
+    if (ev < 0) return 0xFFFF;
+#if HAPPENING_SIZE == 2
+    happening = (uint16_t)ev << 8;
+    ev = getEv(tableIndex, 1);
+    if (ev < 0) return 0xFFFF;
+    happening |= (uint8_t)ev;
+#else
+    happening = (uint8_t)ev;
+#endif
+    return happening;
+}
+#endif
+
 #endif
 
@@ -80,6 +80,14 @@
  * - #define EVENT_TABLE_WIDTH   This the the width of the table - not the 
  *                       number of EVs per event as multiple rows in
  *                       the table can be used to store an event.
+ * - #define EVENT_TABLE_COMPACT Optional. If defined each row of the table 
+ *                        only takes 6+EVENT_TABLE_WIDTH bytes rather than 16
+ *                        and continuation rows also hold EVs in the bytes 
+ *                        otherwise used for the NN and EN, so EVENT_TABLE_WIDTH 
+ *                        can be set to the number of EVs commonly used and more
+ *                        events fit in the same memory. EVENT_TABLE_WIDTH must
+ *                        then be no more than 11. Changes the layout of the
+ *                        table in NVM.
  * - #define NUM_EVENTS          The number of rows in the event table. The
  *                        actual number of events may be less than this
  *                        if any events use more the 1 row.
@@ -91,11 +99,48 @@
  *                        of the hash.
  * - #define EVENT_CHAIN_LENGTH    If hash tables are used then this sets the number
  *                        of events in the hash chain.
+ * - #define EVENT_OVERFLOW_LENGTH Optional. If hash tables are used this sets the
+ *                        number of events which can be indexed once their hash
+ *                        chain is full. Defaults to 8.
+ * - #define EVENT_FIXED_HASH_ADDRESS Optional. If defined then a minimal perfect
+ *                        hash of the events is kept in flash at this address, 
+ *                        needing EVENT_FIXED_HASH_SIZE bytes. It is built at 
+ *                        power up, or by calling buildFixedEventHash(), and is
+ *                        used by findEvent() until an event is added or 
+ *                        removed. At power up the stored hash is checked
+ *                        against the event table, so a table written directly
+ *                        (e.g. by an image import) causes a rebuild. For 
+ *                        modules whose events rarely change this
+ *                        gives quick lookups without the RAM of EVENT_HASH_TABLE.
  * - #define MAX_HAPPENING         Set to be the maximum Happening value
+ * - #define TEACH_TRANSACTION_TIMEOUT Optional. The time after the last change
+ *                        in Learn mode, or in a transaction, before changes are
+ *                        written to flash. Defaults to ONE_SECOND.
+ * - #define EVENT_DEFRAG_AT_IDLE  Optional. If defined then the event table is 
+ *                        compacted a step at a time whilst in Normal mode after
+ *                        it has been changed.
+ * - #define EVENT_DEFRAG_DELAY    Optional. The time after the table was last 
+ *                        changed, or EN# indexes were last sent or read, before
+ *                        the idle compaction starts. Defaults to 60*ONE_SECOND.
+ * - #define EVENT_DEFRAG_JOURNAL_ADDRESS Optional. The address of the journal
+ *                        used to make compaction safe against a reset, needing
+ *                        2*EVENTTABLE_ROW_WIDTH+9 bytes of EVENT_TABLE_NVM_TYPE.
+ *                        Defaults to immediately after the event table.
  * 
  */
 extern const Service eventTeachService;
 
+/* The list of the diagnostics supported */
+#define NUM_TEACH_DIAGNOSTICS 8 ///< The number of diagnostic values for this service
+#define TEACH_DIAGNOSTICS_HASH_LOAD     0x00    ///< Percentage of the hash chain slots in use.
+#define TEACH_DIAGNOSTICS_LONGEST_CHAIN 0x01    ///< Number of events in the longest hash chain.
+#define TEACH_DIAGNOSTICS_OVERFLOW      0x02    ///< Number of events in the overflow list.
+#define TEACH_DIAGNOSTICS_UNINDEXED     0x03    ///< Set to 1 if some events couldn't be indexed.
+#define TEACH_DIAGNOSTICS_SCATTERED     0x04    ///< Number of chained rows which aren't in the following row.
+#define TEACH_DIAGNOSTICS_FREE_GAPS     0x05    ///< Number of free rows before the last used row.
+#define TEACH_DIAGNOSTICS_DEFRAGS       0x06    ///< Number of times the table has been compacted.
+#define TEACH_DIAGNOSTICS_FIXED_HASH    0x07    ///< Set to 1 if the perfect hash is being used to find events.
+
 /**
  * Function called before the EV is saved. This allows the application to perform additional
  * behaviour and to validate that the EV is acceptable.
@@ -108,11 +153,20 @@ extern const Service eventTeachService;
 extern uint8_t APP_addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8_t evVal);
 
 extern Boolean validStart(uint8_t index);
+extern uint8_t nextValidStart(uint8_t tableIndex);
 extern int16_t getEv(uint8_t tableIndex, uint8_t evIndex);
 extern uint16_t getNN(uint8_t tableIndex);
 extern uint16_t getEN(uint8_t tableIndex);
 extern uint8_t findEvent(uint16_t nodeNumber, uint16_t eventNumber);
 extern uint8_t addEvent(uint16_t nodeNumber, uint16_t eventNumber, uint8_t evNum, uint8_t evVal, uint8_t forceOwnNN);
+extern void beginTeachTransaction(void);
+extern void commitTeachTransaction(void);
+extern void defragEventTable(void);
+#ifdef EVENT_FIXED_HASH_ADDRESS
+#define FIXED_HASH_MAX_BUCKETS  NUM_EVENTS
+#define EVENT_FIXED_HASH_SIZE   (3+FIXED_HASH_MAX_BUCKETS+(FIXED_HASH_MAX_BUCKETS+7)/8+NUM_EVENTS)
+extern Boolean buildFixedEventHash(void);
+#endif
 #ifdef EVENT_HASH_TABLE
 extern void rebuildHashtable(void);
 extern uint8_t getHash(uint16_t nodeNumber, uint16_t eventNumber);
@@ -164,11 +218,41 @@ typedef struct {
 #define EVENTTABLE_OFFSET_NN       2
 #define EVENTTABLE_OFFSET_EN       4
 #define EVENTTABLE_OFFSET_EVS      6
+#ifdef EVENT_TABLE_COMPACT
+#if EVENT_TABLE_WIDTH > 11
+#error "EVENT_TABLE_WIDTH must be no more than 11 when using EVENT_TABLE_COMPACT"
+#endif
+#define EVENTTABLE_ROW_WIDTH       (EVENTTABLE_OFFSET_EVS+EVENT_TABLE_WIDTH)
+// continuation rows use the NN and EN bytes for EVs too
+#define EVENTTABLE_OFFSET_MORE_EVS EVENTTABLE_OFFSET_NN
+#define EVENTTABLE_MORE_WIDTH      (EVENT_TABLE_WIDTH+4)
+#else
 #define EVENTTABLE_ROW_WIDTH       16
+#define EVENTTABLE_OFFSET_MORE_EVS EVENTTABLE_OFFSET_EVS
+#define EVENTTABLE_MORE_WIDTH      EVENT_TABLE_WIDTH
+#endif
 
 #define NO_INDEX            0xff
 #define EV_FILL             0xff
 
+extern void getEvent(uint8_t tableIndex, Event * event);
+extern void readEventRow(uint8_t tableIndex, EventTable * row);
+
+/*
+ * All of the EVs of an event as read by getEVs().
+ */
+extern uint8_t evs[PARAM_NUM_EV_EVENT];
+extern uint8_t getEVs(uint8_t tableIndex);
+
+/*
+ * Bits set each time the event table is changed, one for each service which
+ * keeps things decoded from the table.
+ */
+extern uint8_t eventTableChanged;
+#define EVENT_TABLE_CHANGED_ACTIONS     0x01    // event_consumer action lists
+#define EVENT_TABLE_CHANGED_PRODUCED    0x02    // event_producer produced cache
+#define EVENT_TABLE_CHANGED_ALL         0xFF
+
 // EVENT DECODING
 //    An event opcode has bits 4 and 7 set, bits 1 and 2 clear
 //    An ON event opcode also has bit 0 clear
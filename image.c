@@ -0,0 +1,341 @@
+/**
+ * @copyright Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+ */
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+
+#include <xc.h>
+#include "module.h"
+#include "merglcb.h"
+#include "romops.h"
+#include "event_teach.h"
+#include "nv.h"
+#include "image.h"
+
+/**
+ * @file
+ * Export and import of a module's configuration as a single binary image.
+ * @details
+ * The body of the image is read directly from the event table and NVs in NVM.
+ * When importing, the body is written through romops as it arrives so flash is
+ * written a block at a time. The CRC is accumulated as the bytes are read or
+ * written so no more than the header is held in RAM. When checking, the bytes
+ * are treated in the same way but not written.
+ */
+
+#define IMAGE_EVENT_BYTES   ((uint16_t)NUM_EVENTS*EVENTTABLE_ROW_WIDTH)
+#define IMAGE_BODY_LENGTH   (IMAGE_EVENT_BYTES+NV_NUM)
+
+static uint8_t imageHeader[IMAGE_HEADER_SIZE];
+static uint16_t imageCrc;
+static uint16_t imageWriteOffset;
+static uint8_t imageWriteError;
+static Boolean imageCheckOnly;      // the image is being checked, not written
+
+/**
+ * Add a byte to a CRC-16/CCITT.
+ * @param crc the CRC so far
+ * @param value the byte
+ * @return the updated CRC
+ */
+static uint16_t crcByte(uint16_t crc, uint8_t value) {
+    uint8_t i;
+
+    crc ^= (uint16_t)value << 8;
+    for (i=0; i<8; i++) {
+        if (crc & 0x8000) {
+            crc = (crc << 1) ^ 0x1021;
+        } else {
+            crc <<= 1;
+        }
+    }
+    return crc;
+}
+
+/**
+ * Fill in the header for this module, apart from the CRC.
+ * @param header where the header is to be put
+ */
+static void makeHeader(uint8_t * header) {
+    header[IMAGE_OFFSET_MAGIC] = 'L';
+    header[IMAGE_OFFSET_MAGIC+1] = 'I';
+    header[IMAGE_OFFSET_FORMAT] = IMAGE_FORMAT_VERSION;
+    header[IMAGE_OFFSET_NVM_VERSION] = APP_NVM_VERSION;
+    header[IMAGE_OFFSET_MANU] = PARAM_MANU;
+    header[IMAGE_OFFSET_MODULE_ID] = PARAM_MODULE_ID;
+    header[IMAGE_OFFSET_NUM_EVENTS] = NUM_EVENTS;
+    header[IMAGE_OFFSET_ROW_WIDTH] = EVENTTABLE_ROW_WIDTH;
+    header[IMAGE_OFFSET_TABLE_WIDTH] = EVENT_TABLE_WIDTH;
+    header[IMAGE_OFFSET_NUM_EVS] = PARAM_NUM_EV_EVENT;
+    header[IMAGE_OFFSET_NUM_NVS] = NV_NUM;
+#ifdef EVENT_TABLE_COMPACT
+    header[IMAGE_OFFSET_LAYOUT] = IMAGE_LAYOUT_COMPACT;
+#else
+    header[IMAGE_OFFSET_LAYOUT] = 0;
+#endif
+    header[IMAGE_OFFSET_LENGTH] = IMAGE_BODY_LENGTH & 0xFF;
+    header[IMAGE_OFFSET_LENGTH+1] = IMAGE_BODY_LENGTH >> 8;
+}
+
+/**
+ * Read part of the body of the image from NVM.
+ * @param offset the offset within the body
+ * @param buffer where the bytes are to be put
+ * @param len the number of bytes, must not cross from the events to the NVs
+ */
+static void readBody(uint16_t offset, uint8_t * buffer, uint8_t len) {
+    if (offset < IMAGE_EVENT_BYTES) {
+        readNVMBlock(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + offset, buffer, len);
+    } else {
+        readNVMBlock(NV_NVM_TYPE, NV_ADDRESS + 1 + (offset - IMAGE_EVENT_BYTES), buffer, len);
+    }
+}
+
+/**
+ * The total length of the image including the header.
+ * @return the number of bytes
+ */
+uint16_t imageLength(void) {
+    return IMAGE_HEADER_SIZE + IMAGE_BODY_LENGTH;
+}
+
+/**
+ * Prepare the header, including the CRC of the body, ready for the image to be
+ * read using readImage().
+ */
+void beginImageRead(void) {
+    uint16_t offset;
+    uint8_t buffer[16];
+    uint8_t len;
+    uint8_t i;
+
+#ifdef NV_WRITE_BACK
+    // the image is read from NVM so it must be up to date
+    flushNVs();
+#endif
+    makeHeader(imageHeader);
+    imageCrc = 0xFFFF;
+    for (offset=0; offset < IMAGE_BODY_LENGTH; offset += len) {
+        len = sizeof(buffer);
+        if ((offset < IMAGE_EVENT_BYTES) && (offset + len > IMAGE_EVENT_BYTES)) {
+            len = (uint8_t)(IMAGE_EVENT_BYTES - offset);
+        }
+        if (offset + len > IMAGE_BODY_LENGTH) {
+            len = (uint8_t)(IMAGE_BODY_LENGTH - offset);
+        }
+        readBody(offset, buffer, len);
+        for (i=0; i<len; i++) {
+            imageCrc = crcByte(imageCrc, buffer[i]);
+        }
+    }
+    imageHeader[IMAGE_OFFSET_CRC] = imageCrc & 0xFF;
+    imageHeader[IMAGE_OFFSET_CRC+1] = imageCrc >> 8;
+}
+
+/**
+ * Read part of the image. beginImageRead() must have been called first.
+ * @param offset the offset within the image
+ * @param buffer where the bytes are to be put
+ * @param len the number of bytes
+ * @return IMAGE_OK or IMAGE_ERR_LENGTH if beyond the end of the image
+ */
+uint8_t readImage(uint16_t offset, uint8_t * buffer, uint8_t len) {
+    uint8_t n;
+
+    if (offset + len > imageLength()) {
+        return IMAGE_ERR_LENGTH;
+    }
+    // the header part
+    while ((len > 0) && (offset < IMAGE_HEADER_SIZE)) {
+        *buffer++ = imageHeader[offset++];
+        len--;
+    }
+    // the body part, split where it moves from the events to the NVs
+    while (len > 0) {
+        n = len;
+        offset -= IMAGE_HEADER_SIZE;
+        if ((offset < IMAGE_EVENT_BYTES) && (offset + n > IMAGE_EVENT_BYTES)) {
+            n = (uint8_t)(IMAGE_EVENT_BYTES - offset);
+        }
+        readBody(offset, buffer, n);
+        offset += IMAGE_HEADER_SIZE + n;
+        buffer += n;
+        len -= n;
+    }
+    return IMAGE_OK;
+}
+
+/**
+ * Check that the header of an image being imported is suitable for this module.
+ * @return IMAGE_OK or the error
+ */
+static uint8_t checkHeader(void) {
+    uint8_t expected[IMAGE_HEADER_SIZE];
+
+    makeHeader(expected);
+    if ((imageHeader[IMAGE_OFFSET_MAGIC] != expected[IMAGE_OFFSET_MAGIC])
+            || (imageHeader[IMAGE_OFFSET_MAGIC+1] != expected[IMAGE_OFFSET_MAGIC+1])
+            || (imageHeader[IMAGE_OFFSET_FORMAT] != expected[IMAGE_OFFSET_FORMAT])) {
+        return IMAGE_ERR_FORMAT;
+    }
+    if ((imageHeader[IMAGE_OFFSET_NVM_VERSION] != expected[IMAGE_OFFSET_NVM_VERSION])
+            || (imageHeader[IMAGE_OFFSET_MANU] != expected[IMAGE_OFFSET_MANU])
+            || (imageHeader[IMAGE_OFFSET_MODULE_ID] != expected[IMAGE_OFFSET_MODULE_ID])) {
+        return IMAGE_ERR_MODULE;
+    }
+    if ((imageHeader[IMAGE_OFFSET_NUM_EVENTS] != expected[IMAGE_OFFSET_NUM_EVENTS])
+            || (imageHeader[IMAGE_OFFSET_ROW_WIDTH] != expected[IMAGE_OFFSET_ROW_WIDTH])
+            || (imageHeader[IMAGE_OFFSET_TABLE_WIDTH] != expected[IMAGE_OFFSET_TABLE_WIDTH])
+            || (imageHeader[IMAGE_OFFSET_NUM_EVS] != expected[IMAGE_OFFSET_NUM_EVS])
+            || (imageHeader[IMAGE_OFFSET_NUM_NVS] != expected[IMAGE_OFFSET_NUM_NVS])
+            || (imageHeader[IMAGE_OFFSET_LAYOUT] != expected[IMAGE_OFFSET_LAYOUT])) {
+        return IMAGE_ERR_GEOMETRY;
+    }
+    if ((imageHeader[IMAGE_OFFSET_LENGTH] != expected[IMAGE_OFFSET_LENGTH])
+            || (imageHeader[IMAGE_OFFSET_LENGTH+1] != expected[IMAGE_OFFSET_LENGTH+1])) {
+        return IMAGE_ERR_LENGTH;
+    }
+    return IMAGE_OK;
+}
+
+/**
+ * Start to import an image. The body is written over the current event table
+ * and NVs as it arrives.
+ */
+void beginImageWrite(void) {
+#ifdef NV_WRITE_BACK
+    // stop outstanding changes overwriting the image
+    flushNVs();
+#endif
+    imageWriteOffset = 0;
+    imageWriteError = IMAGE_OK;
+    imageCrc = 0xFFFF;
+    imageCheckOnly = FALSE;
+}
+
+/**
+ * Start to check an image. The image is passed to writeImage() and 
+ * endImageWrite() as for an import but nothing is written, so that a damaged
+ * image can be found before it replaces the current configuration.
+ */
+void beginImageCheck(void) {
+    imageWriteOffset = 0;
+    imageWriteError = IMAGE_OK;
+    imageCrc = 0xFFFF;
+    imageCheckOnly = TRUE;
+}
+
+/**
+ * Write the next part of an image. The bytes must be supplied in order. Once
+ * the whole header has been received it is checked and, if it is not suitable,
+ * nothing is written to NVM.
+ * @param offset the offset within the image, must follow on from the previous write
+ * @param buffer the bytes
+ * @param len the number of bytes
+ * @return IMAGE_OK or the error
+ */
+uint8_t writeImage(uint16_t offset, uint8_t * buffer, uint8_t len) {
+    uint16_t bodyOffset;
+
+    if (imageWriteError != IMAGE_OK) {
+        return imageWriteError;
+    }
+    if (offset != imageWriteOffset) {
+        return IMAGE_ERR_SEQUENCE;
+    }
+    if (offset + len > imageLength()) {
+        imageWriteError = IMAGE_ERR_LENGTH;
+        return imageWriteError;
+    }
+    for (; len > 0; len--, offset++, buffer++) {
+        if (offset < IMAGE_HEADER_SIZE) {
+            imageHeader[offset] = *buffer;
+            if (offset == IMAGE_HEADER_SIZE-1) {
+                imageWriteError = checkHeader();
+                if (imageWriteError != IMAGE_OK) {
+                    return imageWriteError;
+                }
+            }
+            continue;
+        }
+        bodyOffset = offset - IMAGE_HEADER_SIZE;
+        imageCrc = crcByte(imageCrc, *buffer);
+        if (imageCheckOnly) {
+            continue;
+        }
+        if (bodyOffset < IMAGE_EVENT_BYTES) {
+            writeNVM(EVENT_TABLE_NVM_TYPE, EVENT_TABLE_ADDRESS + bodyOffset, *buffer);
+        } else {
+            writeNVM(NV_NVM_TYPE, NV_ADDRESS + 1 + (bodyOffset - IMAGE_EVENT_BYTES), *buffer);
+        }
+    }
+    imageWriteOffset = offset;
+    return IMAGE_OK;
+}
+
+/**
+ * Complete the import of an image. The CRC is checked and the RAM tables of
+ * the Event Teach and NV services are rebuilt from the new contents of NVM.
+ * If the image was incomplete or the CRC is wrong, but some of the body has
+ * been written, the event table and NVs are set back to factory defaults.
+ * After beginImageCheck() only the checks are done.
+ * @return IMAGE_OK or the error
+ */
+uint8_t endImageWrite(void) {
+    uint8_t result;
+
+    result = imageWriteError;
+    if ((result == IMAGE_OK) && (imageWriteOffset != imageLength())) {
+        result = IMAGE_ERR_LENGTH;
+    }
+    if ((result == IMAGE_OK) &&
+            ((imageHeader[IMAGE_OFFSET_CRC] != (imageCrc & 0xFF))
+            || (imageHeader[IMAGE_OFFSET_CRC+1] != (imageCrc >> 8)))) {
+        result = IMAGE_ERR_CRC;
+    }
+    if (imageCheckOnly) {
+        imageWriteOffset = 0;
+        imageWriteError = IMAGE_ERR_SEQUENCE;
+        return result;
+    }
+    if ((result != IMAGE_OK) && (imageWriteOffset > IMAGE_HEADER_SIZE)) {
+        // don't leave a partial or corrupt configuration
+        eventTeachService.factoryReset();
+        nvService.factoryReset();
+    }
+    flushFlashBlock();
+    eventTeachService.powerUp();
+    nvService.powerUp();
+    imageWriteOffset = 0;
+    imageWriteError = IMAGE_ERR_SEQUENCE;
+    return result;
+}
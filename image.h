@@ -0,0 +1,169 @@
+#ifndef _IMAGE_H_
+/**
+ * @copyright Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+ */
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+#define _IMAGE_H_
+
+/**
+ * @file
+ * Export and import of a module's configuration as a single binary image.
+ * @details
+ * The image contains the event table and the NVs so that the configuration of
+ * a module can be copied to a replacement module far quicker than by reading
+ * and teaching each event and EV.
+ *
+ * The image consists of a 16 byte header followed by the body. The body is the
+ * event table rows exactly as stored in NVM, NUM_EVENTS*EVENTTABLE_ROW_WIDTH
+ * bytes, followed by NV#1 to NV#NV_NUM. Multi-byte values in the header are
+ * stored low byte first. The header is:
+ * <pre>
+ * offset  size  contents
+ * 0       2     'L' 'I' magic
+ * 2       1     IMAGE_FORMAT_VERSION
+ * 3       1     APP_NVM_VERSION
+ * 4       1     PARAM_MANU
+ * 5       1     PARAM_MODULE_ID
+ * 6       1     NUM_EVENTS
+ * 7       1     EVENTTABLE_ROW_WIDTH
+ * 8       1     EVENT_TABLE_WIDTH
+ * 9       1     PARAM_NUM_EV_EVENT
+ * 10      1     NV_NUM
+ * 11      1     layout flags, IMAGE_LAYOUT_COMPACT if EVENT_TABLE_COMPACT
+ * 12      2     length of the body
+ * 14      2     CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF) of the body
+ * </pre>
+ * An image is only accepted by a module with the same module type, NVM version,
+ * table geometry and layout.
+ *
+ * To export call beginImageRead(), which calculates the CRC, and then
+ * readImage() for successive parts of the imageLength() bytes.
+ *
+ * To import call beginImageWrite() and then writeImage() with the bytes of the
+ * image in order. The header is checked before any of the body is written.
+ * Finally call endImageWrite() which checks the CRC and rebuilds the RAM
+ * tables. The event table and NVs must not be used whilst an import is in 
+ * progress.
+ *
+ * IMPORTANT: there is no room to hold the image before it is written, so the
+ * body is written over the module's current configuration as it arrives and
+ * the CRC can only be checked at the end. If the CRC is wrong, or the import is
+ * not completed, the event table and NVs are set back to their factory 
+ * defaults rather than leaving a corrupt configuration. The previous 
+ * configuration is lost. To guard against a damaged image first send it after
+ * beginImageCheck() instead of beginImageWrite(); this checks the header, 
+ * length and CRC without writing anything, and endImageWrite() returns the
+ * result. Only then send it again to write it.
+ *
+ * tools/imagetool.cpp is a host program to list, compare and merge images.
+ *
+ * # Dependencies on other Services
+ * The Event Teach and NV services.
+ */
+
+#include "merglcb.h"
+
+#define IMAGE_FORMAT_VERSION    1
+#define IMAGE_HEADER_SIZE       16
+
+#define IMAGE_OFFSET_MAGIC      0
+#define IMAGE_OFFSET_FORMAT     2
+#define IMAGE_OFFSET_NVM_VERSION 3
+#define IMAGE_OFFSET_MANU       4
+#define IMAGE_OFFSET_MODULE_ID  5
+#define IMAGE_OFFSET_NUM_EVENTS 6
+#define IMAGE_OFFSET_ROW_WIDTH  7
+#define IMAGE_OFFSET_TABLE_WIDTH 8
+#define IMAGE_OFFSET_NUM_EVS    9
+#define IMAGE_OFFSET_NUM_NVS    10
+#define IMAGE_OFFSET_LAYOUT     11
+#define IMAGE_OFFSET_LENGTH     12
+#define IMAGE_OFFSET_CRC        14
+
+/* The layout flags */
+#define IMAGE_LAYOUT_COMPACT    0x01    ///< rows are stored as EVENT_TABLE_COMPACT
+
+/* The results of the image functions */
+#define IMAGE_OK                0   ///< Success
+#define IMAGE_ERR_FORMAT        1   ///< Not an image or an unknown format version
+#define IMAGE_ERR_MODULE        2   ///< Image is from a different module type or NVM version
+#define IMAGE_ERR_GEOMETRY      3   ///< Image has a different event table or number of NVs
+#define IMAGE_ERR_SEQUENCE      4   ///< Bytes were not written in order
+#define IMAGE_ERR_LENGTH        5   ///< Too many or too few bytes
+#define IMAGE_ERR_CRC           6   ///< The body doesn't match the CRC
+
+/*
+ * The total length of the image including the header.
+ */
+extern uint16_t imageLength(void);
+
+/*
+ * Prepare the header, including the CRC, for reading an image.
+ */
+extern void beginImageRead(void);
+
+/*
+ * Read part of the image.
+ * @param offset the offset within the image
+ * @param buffer where the bytes are to be put
+ * @param len the number of bytes
+ * @return IMAGE_OK or IMAGE_ERR_LENGTH if beyond the end of the image
+ */
+extern uint8_t readImage(uint16_t offset, uint8_t * buffer, uint8_t len);
+
+/*
+ * Start to import an image, writing it over the current configuration.
+ */
+extern void beginImageWrite(void);
+
+/*
+ * Start to check an image, as for an import but without writing anything.
+ */
+extern void beginImageCheck(void);
+
+/*
+ * Write the next part of an image.
+ * @param offset the offset within the image, must follow on from the previous write
+ * @param buffer the bytes
+ * @param len the number of bytes
+ * @return IMAGE_OK or the error
+ */
+extern uint8_t writeImage(uint16_t offset, uint8_t * buffer, uint8_t len);
+
+/*
+ * Complete the import, or the check, of an image.
+ * @return IMAGE_OK or the error
+ */
+extern uint8_t endImageWrite(void);
+
+#endif
@@ -569,6 +569,31 @@ static Message tmpMessage;
  */
 static TickValue timedResponseTime;
 
+/**
+ * The interval between bursts of timedResponse steps. May be overridden in 
+ * module.h.
+ */
+#ifndef TIMED_RESPONSE_INTERVAL
+#define TIMED_RESPONSE_INTERVAL     TEN_MILI_SECOND
+#endif
+/**
+ * The maximum number of timedResponse steps in each interval. This sets the 
+ * ceiling on the share of the bus used by timedResponse messages. A frame 
+ * takes about 1ms at 125kbit/s so the defaults allow around 20% of the bus.
+ * May be overridden in module.h.
+ */
+#ifndef TIMED_RESPONSE_MAX_STEPS
+#define TIMED_RESPONSE_MAX_STEPS    2
+#endif
+/**
+ * The number of transmit buffers to be left free for other messages. 
+ * TimedResponse steps stop for the interval once the transport has no more
+ * than this number of free buffers. May be overridden in module.h.
+ */
+#ifndef TIMED_RESPONSE_TX_RESERVE
+#define TIMED_RESPONSE_TX_RESERVE   0
+#endif
+
 /** APP externs */
 extern Processed APP_preProcessMessage(Message * m);
 extern Processed APP_postProcessMessage(Message * m);
@@ -684,9 +709,18 @@ static void poll(void) {
     Message m;
     uint8_t handled;
     
-    /* handle any timed responses */
-    if (tickTimeSince(timedResponseTime) > 5*FIVE_MILI_SECOND) {
-        pollTimedResponse();
+    /* handle any timed responses, pacing them by the transmit buffer space */
+    if (tickTimeSince(timedResponseTime) > TIMED_RESPONSE_INTERVAL) {
+        for (i=0; i<TIMED_RESPONSE_MAX_STEPS; i++) {
+            if ((transport == NULL) || (transport->sendSpace == NULL)) {
+                // transport can't tell us so just do one step
+                if (i > 0) break;
+            } else if (transport->sendSpace() <= TIMED_RESPONSE_TX_RESERVE) {
+                // back off until the buffers have drained
+                break;
+            }
+            if ( ! pollTimedResponse()) break;
+        }
         timedResponseTime.val = tickGet();
     }
     /* call any service polls */
@@ -695,6 +729,8 @@ static void poll(void) {
             services[i]->poll();
         }
     }
+    /* write back any changed flash once writing has finished */
+    pollRomOps();
     
     // Handle any incoming messages from the transport
     handled = 0;
@@ -978,6 +1014,9 @@ void __interrupt(low_priority) __section("mainSec") isrLow() {
 void __interrupt(low_priority, base(0x0808)) isrLow() {
 #endif
 
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+    eepromIsr();
+#endif
     lowIsr();
 }
 
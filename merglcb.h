@@ -622,6 +622,7 @@ typedef enum SendResult {
 typedef struct Transport {
     SendResult (* sendMessage)(Message * m);   // function call to send a message
     MessageReceived (* receiveMessage)(Message * m); // check to see if message is available and return in the structure provided
+    uint8_t (* sendSpace)(void);                // number of messages which can be sent without the transmit buffer overflowing
  //   void (* releaseMessage)(Message * m);   // App has finished with message
 } Transport;
 /**
@@ -125,6 +125,9 @@ static DiagnosticVal * mnsGetDiagnostic(uint8_t index);
 #include "event_producer.h"
 Boolean sendProducedEvent(Happening happening, EventState onOff);
 #endif
+#ifdef NV_WRITE_BACK
+#include "nv.h"
+#endif
 
 void setLEDsByMode(void);
 
@@ -548,6 +551,9 @@ static Processed mnsProcessMessage(Message * m) {
                 return PROCESSED;
             }
             newMode = m->bytes[2];
+#ifdef NV_WRITE_BACK
+            flushNVs();
+#endif
             // check current mode
             switch (mode) {
                 case MODE_UNINITIALISED:
@@ -597,6 +603,12 @@ static Processed mnsProcessMessage(Message * m) {
             }
             return PROCESSED; */
         case OPC_NNRST: // reset CPU
+#ifdef NV_WRITE_BACK
+            flushNVs();
+#endif
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+            flushEeprom();
+#endif
             RESET();
             return PROCESSED;
         default:
@@ -47,6 +47,16 @@
  * If NV_CACHE is defined in module.h then the NV service implements a cache
  * of NV values in RAM. This can be used to speed up obtaining NV values used 
  * within the application at the expense of additional RAM usage.
+ * 
+ * If NV_WRITE_BACK is also defined then setNV() only updates the cache and 
+ * marks the NV as dirty. The dirty NVs are written to NVM by the poll, one per
+ * call, once no NV has been set for NV_FLUSH_DELAY so that a burst of NVSETs 
+ * is not held up by the NVM writes and repeated writes of the same NV are 
+ * combined. flushNVs() writes all dirty NVs immediately.
+ * 
+ * If NV_DESCRIPTORS is defined then the defaults and validation of the NVs 
+ * come from the application's nvDescriptors[] table rather than by calling
+ * APP_nvDefault() and APP_nvValidate().
  */
 
 #include <xc.h>
@@ -56,6 +66,20 @@
 #include "mns.h"
 #include "romops.h"
 #include "timedResponse.h"
+#include "ticktime.h"
+
+#ifdef NV_WRITE_BACK
+#ifndef NV_CACHE
+#error "NV_WRITE_BACK requires NV_CACHE"
+#endif
+/**
+ * The time without an NV being set before dirty NVs are written to NVM. May
+ * be overridden in module.h.
+ */
+#ifndef NV_FLUSH_DELAY
+#define NV_FLUSH_DELAY  ONE_SECOND
+#endif
+#endif
 
 // forward declarations
 static void loadNVcahe(void);
@@ -65,6 +89,20 @@ static Processed nvProcessMessage(Message *m);
 static uint8_t nvGetESDdata(uint8_t id);
 TimedResponseResult nvTRnvrdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step);
 static DiagnosticVal * nvGetDiagnostic(uint8_t index);
+#ifdef NV_WRITE_BACK
+static void nvPoll(void);
+static void writeDirtyNV(uint8_t index);
+#endif
+#ifdef NV_BULK
+TimedResponseResult nvTRnvrdbCallback(uint8_t type, uint8_t serviceIndex, uint8_t step);
+static void nvBulkError(uint8_t opc, uint8_t error);
+#endif
+#ifdef NV_DESCRIPTORS
+TimedResponseResult nvTRnvdscCallback(uint8_t type, uint8_t serviceIndex, uint8_t step);
+static void sendNvDescription(uint8_t index);
+#endif
+static uint8_t nvDefault(uint8_t index);
+static NvValidation nvValidate(uint8_t index, uint8_t value);
 
 /**
  * The service descriptor for the NV service. The application must include this
@@ -78,7 +116,11 @@ const Service nvService = {
     nvFactoryReset,     // factoryReset
     nvPowerUp,          // powerUp
     nvProcessMessage,   // processMessage
+#ifdef NV_WRITE_BACK
+    nvPoll,             // poll
+#else
     NULL,               // poll
+#endif
     NULL,               // highIsr
     NULL,               // lowIsr
     nvGetESDdata,       // get ESD data
@@ -93,6 +135,17 @@ static DiagnosticVal nvDiagnostics[NUM_NV_DIAGNOSTICS];
 #ifdef NV_CACHE
 static uint8_t nvCache[NV_NUM+1];
 #endif
+#ifdef NV_WRITE_BACK
+static uint8_t nvDirty[(NV_NUM+8)/8];  // a bit for each NV not yet written to NVM
+static uint8_t nvNumDirty;
+static TickValue nvSetTime;             // when an NV was last set
+#endif
+#ifdef NV_BULK
+static uint8_t bulkReadFirst;       // the first NV of the block being read
+static uint8_t bulkReadCount;
+static uint8_t bulkWriteNext;       // the index expected in the next NVSETB
+static uint8_t bulkWriteRemaining;  // the NVs still to be written, 0 if no block write
+#endif
 
 /* externs back into APP */
 extern void APP_nvValueChanged(uint8_t index, uint8_t value, uint8_t oldValue);
@@ -103,9 +156,80 @@ extern void APP_nvValueChanged(uint8_t index, uint8_t value, uint8_t oldValue);
  */
 static void nvFactoryReset(void) {
     uint8_t i;
+#ifdef NV_WRITE_BACK
+    // forget the changes, they mustn't overwrite the defaults
+    for (i=0; i<sizeof(nvDirty); i++) {
+        nvDirty[i] = 0;
+    }
+    nvNumDirty = 0;
+#endif
+#ifdef NV_DESCRIPTORS
+    {
+        uint8_t buffer[16];
+        uint8_t j;
+        uint8_t len;
+        
+        // only write the NVs which differ from their default
+        for (i=1; i<=NV_NUM; i+=len) {
+            len = sizeof(buffer);
+            if (i + len - 1 > NV_NUM) {
+                len = (uint8_t)(NV_NUM - i + 1);
+            }
+            readNVMBlock(NV_NVM_TYPE, NV_ADDRESS+i, buffer, len);
+            for (j=0; j<len; j++) {
+#ifdef NV_CACHE
+                if (nvDescriptors[i+j-1].flags & NV_FLAG_VOLATILE) continue;
+#endif
+                if (buffer[j] != nvDescriptors[i+j-1].defaultValue) {
+                    writeNVM(NV_NVM_TYPE, NV_ADDRESS+i+j, nvDescriptors[i+j-1].defaultValue);
+                }
+            }
+        }
+        if (NV_NVM_TYPE == FLASH_NVM_TYPE) {
+            flushFlashBlock();
+        }
+    }
+#else
     for (i=1; i<= NV_NUM; i++) {
         writeNVM(NV_NVM_TYPE, NV_ADDRESS+i, APP_nvDefault(i));
     }
+#endif
+}
+
+/**
+ * Get the factory default value of an NV.
+ * @param index the NV index, 1..NV_NUM
+ * @return the default value
+ */
+static uint8_t nvDefault(uint8_t index) {
+#ifdef NV_DESCRIPTORS
+    return nvDescriptors[index-1].defaultValue;
+#else
+    return APP_nvDefault(index);
+#endif
+}
+
+/**
+ * Check whether a value may be written to an NV.
+ * @param index the NV index, 1..NV_NUM
+ * @param value the proposed value
+ * @return whether the value is acceptable
+ */
+static NvValidation nvValidate(uint8_t index, uint8_t value) {
+#ifdef NV_DESCRIPTORS
+    const NvDescriptor * d;
+    
+    d = &(nvDescriptors[index-1]);
+    if (d->flags & NV_FLAG_BITMASK) {
+        // max holds the bits which may be set
+        if (value & ~(d->max)) return INVALID;
+    } else {
+        if ((value < d->min) || (value > d->max)) return INVALID;
+    }
+    return VALID;
+#else
+    return APP_nvValidate(index, value);
+#endif
 }
 
 /**
@@ -138,6 +262,13 @@ static void loadNVcahe(void) {
     int16_t temp;
     
     for (i=1; i<= NV_NUM; i++) {
+#ifdef NV_DESCRIPTORS
+        if (nvDescriptors[i-1].flags & NV_FLAG_VOLATILE) {
+            // not kept in NVM so starts with the default
+            nvCache[i] = nvDefault(i);
+            continue;
+        }
+#endif
         temp = readNVM(NV_NVM_TYPE, NV_ADDRESS+i);
         if (temp < 0) {
             // unsure how to handle an error here
@@ -178,12 +309,33 @@ int16_t getNV(uint8_t index) {
 uint8_t setNV(uint8_t index, uint8_t value) {
     uint8_t oldValue;
     
-    if (index > NV_NUM) return CMDERR_INV_NV_IDX;
-    if (APP_nvValidate(index, value) == INVALID) return CMDERR_INV_NV_VALUE;
+    if ((index == 0) || (index > NV_NUM)) return CMDERR_INV_NV_IDX;
+    if (nvValidate(index, value) == INVALID) return CMDERR_INV_NV_VALUE;
 #ifdef NV_CACHE
     oldValue = nvCache[index];
     nvCache[index] = value;
+#ifdef NV_DESCRIPTORS
+    if (nvDescriptors[index-1].flags & NV_FLAG_VOLATILE) {
+        // only kept in RAM
+        APP_nvValueChanged(index, value, oldValue);
+        return 0;
+    }
+#endif
+#ifdef NV_WRITE_BACK
+    if (nvDirty[index>>3] & (1<<(index&7))) {
+        // the previous value was never written
+        nvDiagnostics[NV_DIAGNOSTICS_WRITES_SAVED].asUint++;
+    } else if (oldValue == value) {
+        // nothing to write
+        nvDiagnostics[NV_DIAGNOSTICS_WRITES_SAVED].asUint++;
+    } else {
+        nvDirty[index>>3] |= (uint8_t)(1<<(index&7));
+        nvNumDirty++;
+    }
+    nvSetTime.val = tickGet();
+#else
     writeNVM(NV_NVM_TYPE, NV_ADDRESS+index, value);
+#endif
 #else
     oldValue = readNVM(NV_NVM_TYPE, NV_ADDRESS+index);
     writeNVM(NV_NVM_TYPE, NV_ADDRESS+index, value);
@@ -192,6 +344,56 @@ uint8_t setNV(uint8_t index, uint8_t value) {
     return 0;
 }
 
+#ifdef NV_WRITE_BACK
+/**
+ * Write a dirty NV to NVM.
+ * @param index the NV index
+ */
+static void writeDirtyNV(uint8_t index) {
+    nvDirty[index>>3] &= (uint8_t)~(1<<(index&7));
+    nvNumDirty--;
+    writeNVM(NV_NVM_TYPE, NV_ADDRESS+index, nvCache[index]);
+}
+
+/**
+ * Write one dirty NV to NVM once NVs have stopped being set.
+ */
+static void nvPoll(void) {
+    uint8_t i;
+    uint8_t bit;
+    
+    if (nvNumDirty == 0) return;
+    if (tickTimeSince(nvSetTime) < NV_FLUSH_DELAY) return;
+    for (i=0; i<sizeof(nvDirty); i++) {
+        if (nvDirty[i] == 0) continue;
+        for (bit=0; ! (nvDirty[i] & (1<<bit)); bit++)
+            ;
+        writeDirtyNV((uint8_t)((i<<3) + bit));
+        break;
+    }
+    if ((nvNumDirty == 0) && (NV_NVM_TYPE == FLASH_NVM_TYPE)) {
+        flushFlashBlock();
+    }
+}
+
+/**
+ * Write all the dirty NVs to NVM now. Must be called before a reset or 
+ * before NVM is accessed directly.
+ */
+void flushNVs(void) {
+    uint8_t i;
+    
+    for (i=1; (i<=NV_NUM) && (nvNumDirty != 0); i++) {
+        if (nvDirty[i>>3] & (1<<(i&7))) {
+            writeDirtyNV(i);
+        }
+    }
+    if (NV_NVM_TYPE == FLASH_NVM_TYPE) {
+        flushFlashBlock();
+    }
+}
+#endif
+
 /**
  * Process the NV related messages.
  * @param m the MERGLCB message
@@ -199,6 +401,9 @@ uint8_t setNV(uint8_t index, uint8_t value) {
  */
 static Processed nvProcessMessage(Message * m) {
     int16_t valueOrError;
+#ifdef NV_BULK
+    uint8_t i;
+#endif
     
     if (m->len < 3) {
         return NOT_PROCESSED;
@@ -208,6 +413,74 @@ static Processed nvProcessMessage(Message * m) {
     if (m->bytes[1] != nn.bytes.lo) return NOT_PROCESSED;
     
     switch (m->opc) {
+#ifdef NV_DESCRIPTORS
+        case OPC_NVRQD:
+            if (m->len < 4) {
+                sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, CMDERR_INV_CMD);
+                sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_NVRQD, SERVICE_ID_NV, CMDERR_INV_CMD);
+                nvDiagnostics[NV_DIAGNOSTICS_NUM_FAIL].asUint++;
+                return PROCESSED;
+            }
+            if (m->bytes[2] > NV_NUM) {
+                sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, CMDERR_INV_NV_IDX);
+                sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_NVRQD, SERVICE_ID_NV, CMDERR_INV_NV_IDX);
+                nvDiagnostics[NV_DIAGNOSTICS_NUM_FAIL].asUint++;
+                return PROCESSED;
+            }
+            if (m->bytes[2] == 0) {
+                // describe all of the NVs
+                startTimedResponse(TIMED_RESPONSE_NVDSC, findServiceIndex(SERVICE_ID_NV), nvTRnvdscCallback);
+            } else {
+                sendNvDescription(m->bytes[2]);
+            }
+            return PROCESSED;
+#endif
+#ifdef NV_BULK
+        case OPC_NVRDB:
+        case OPC_NVWRB:
+            if (m->len < 5) {
+                nvBulkError(m->opc, CMDERR_INV_CMD);
+                return PROCESSED;
+            }
+            if ((m->bytes[2] == 0) || (m->bytes[3] == 0) || 
+                    ((uint16_t)(m->bytes[2]) + m->bytes[3] - 1 > NV_NUM)) {
+                nvBulkError(m->opc, CMDERR_INV_NV_IDX);
+                return PROCESSED;
+            }
+            if (m->opc == OPC_NVRDB) {
+                bulkReadFirst = m->bytes[2];
+                bulkReadCount = m->bytes[3];
+                startTimedResponse(TIMED_RESPONSE_NVRDB, findServiceIndex(SERVICE_ID_NV), nvTRnvrdbCallback);
+            } else {
+                bulkWriteNext = m->bytes[2];
+                bulkWriteRemaining = m->bytes[3];
+            }
+            return PROCESSED;
+        case OPC_NVSETB:
+            if ((m->len < 8) || (bulkWriteRemaining == 0) || (m->bytes[2] != bulkWriteNext)) {
+                // not part of the block being written
+                bulkWriteRemaining = 0;
+                nvBulkError(OPC_NVSETB, CMDERR_INV_CMD);
+                return PROCESSED;
+            }
+            for (i=0; (i<NV_BULK_PER_FRAME) && (bulkWriteRemaining != 0); i++) {
+                valueOrError = setNV(bulkWriteNext, m->bytes[3+i]);
+                if (valueOrError != 0) {
+                    bulkWriteRemaining = 0;
+                    nvBulkError(OPC_NVSETB, (uint8_t)valueOrError);
+                    return PROCESSED;
+                }
+                bulkWriteNext++;
+                bulkWriteRemaining--;
+                nvDiagnostics[NV_DIAGNOSTICS_NUM_ACCESS].asUint++;
+            }
+            if (bulkWriteRemaining == 0) {
+                // the whole block is done
+                sendMessage2(OPC_WRACK, nn.bytes.hi, nn.bytes.lo);
+                sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, OPC_NVWRB, SERVICE_ID_NV, GRSP_OK);
+            }
+            return PROCESSED;
+#endif
         case OPC_NVRD:
             if (m->len < 4) {
                 sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, CMDERR_INV_CMD);
@@ -297,7 +570,7 @@ static uint8_t nvGetESDdata(uint8_t id) {
  */
 TimedResponseResult nvTRnvrdCallback(uint8_t type, uint8_t serviceIndex, uint8_t step) {
     int16_t valueOrError;
-    if (step > NV_NUM) {
+    if (step >= NV_NUM) {
         return TIMED_RESPONSE_RESULT_FINISHED;
     }
     valueOrError = getNV(step+1);
@@ -307,4 +580,78 @@ TimedResponseResult nvTRnvrdCallback(uint8_t type, uint8_t serviceIndex, uint8_t
     sendMessage4(OPC_NVANS, nn.bytes.hi, nn.bytes.lo, step+1, (uint8_t)(valueOrError));
     nvDiagnostics[NV_DIAGNOSTICS_NUM_ACCESS].asUint++;
     return TIMED_RESPONSE_RESULT_NEXT;
-}
\ No newline at end of file
+}
+
+#ifdef NV_BULK
+/**
+ * Report an error with a bulk NV request.
+ * @param opc the opcode of the request
+ * @param error the error
+ */
+static void nvBulkError(uint8_t opc, uint8_t error) {
+    sendMessage3(OPC_CMDERR, nn.bytes.hi, nn.bytes.lo, error);
+    sendMessage5(OPC_GRSP, nn.bytes.hi, nn.bytes.lo, opc, SERVICE_ID_NV, error);
+    nvDiagnostics[NV_DIAGNOSTICS_NUM_FAIL].asUint++;
+}
+
+/**
+ * The callback used to send a block of NVs, NV_BULK_PER_FRAME in each NVANB.
+ * @param type always set to TIMED_RESPONSE_NVRDB
+ * @param serviceIndex indicates the service requesting the responses
+ * @param step the frame of the block
+ * @return whether all of the responses have been sent yet.
+ */
+TimedResponseResult nvTRnvrdbCallback(uint8_t type, uint8_t serviceIndex, uint8_t step) {
+    uint8_t values[NV_BULK_PER_FRAME];
+    uint8_t offset;
+    uint8_t i;
+    int16_t valueOrError;
+    
+    if (step >= (NV_NUM + NV_BULK_PER_FRAME - 1)/NV_BULK_PER_FRAME) {
+        return TIMED_RESPONSE_RESULT_FINISHED;
+    }
+    offset = step * NV_BULK_PER_FRAME;
+    if (offset >= bulkReadCount) {
+        return TIMED_RESPONSE_RESULT_FINISHED;
+    }
+    for (i=0; i<NV_BULK_PER_FRAME; i++) {
+        valueOrError = -1;
+        if (offset + i < bulkReadCount) {
+            valueOrError = getNV(bulkReadFirst + offset + i);
+            nvDiagnostics[NV_DIAGNOSTICS_NUM_ACCESS].asUint++;
+        }
+        values[i] = (valueOrError < 0) ? 0 : (uint8_t)valueOrError;
+    }
+    sendMessage7(OPC_NVANB, nn.bytes.hi, nn.bytes.lo, bulkReadFirst + offset, 
+            values[0], values[1], values[2], values[3]);
+    return TIMED_RESPONSE_RESULT_NEXT;
+}
+#endif
+
+#ifdef NV_DESCRIPTORS
+/**
+ * Send the NVDSC describing an NV.
+ * @param index the NV index, 1..NV_NUM
+ */
+static void sendNvDescription(uint8_t index) {
+    const NvDescriptor * d;
+    
+    d = &(nvDescriptors[index-1]);
+    sendMessage7(OPC_NVDSC, nn.bytes.hi, nn.bytes.lo, index, d->defaultValue, d->min, d->max, d->flags);
+}
+
+/**
+ * The callback used to describe all of the NVs.
+ * @param type always set to TIMED_RESPONSE_NVDSC
+ * @param serviceIndex indicates the service requesting the responses
+ * @param step the NV index-1
+ * @return whether all of the responses have been sent yet.
+ */
+TimedResponseResult nvTRnvdscCallback(uint8_t type, uint8_t serviceIndex, uint8_t step) {
+    if (step >= NV_NUM) {
+        return TIMED_RESPONSE_RESULT_FINISHED;
+    }
+    sendNvDescription(step+1);
+    return TIMED_RESPONSE_RESULT_NEXT;
+}
+#endif
@@ -54,6 +54,52 @@
  * of NV values in RAM. This can be used to speed up obtaining NV values used 
  * within the application at the expense of additional RAM usage.
  * 
+ * If NV_WRITE_BACK is also defined then changed NVs are written to NVM in the
+ * background once NVs stop being changed, combining repeated changes to the 
+ * same NV. Call flushNVs() to write them immediately. The number of NVM 
+ * writes avoided is available as a diagnostic.
+ * 
+ * If NV_BULK is defined then blocks of NVs can also be read and written with 
+ * four NVs in each frame:
+ * - NVRDB NN first count requests count NVs starting at NV first. They are 
+ *   returned as NVANB NN index v0 v1 v2 v3 frames paced by the timedResponse.
+ *   Values past the end of the block are sent as 0.
+ * - NVWRB NN first count starts writing count NVs starting at NV first. It is 
+ *   followed by NVSETB NN index v0 v1 v2 v3 frames in order of index, the 
+ *   first index being first and each following frame 4 higher. Values past 
+ *   the end of the block are ignored. Each NV is validated and written as for
+ *   NVSET. A single WRACK and GRSP is sent once the whole block is written. An
+ *   invalid NV or frame sends CMDERR and GRSP with the error and abandons the
+ *   rest of the block.
+ * 
+ * The bulk opcodes are PROVISIONAL. Their values have not been allocated by the
+ * MERGLCB specification and may clash with opcodes allocated in future, so 
+ * NV_BULK is off unless defined and is only for use with configuration tools
+ * built with the same values.
+ * 
+ * If NV_DESCRIPTORS is defined then the application provides a const table,
+ * nvDescriptors[], with an entry for each NV giving its default, the allowed 
+ * values and its flags. The table is used for the factory reset, which only 
+ * writes the NVs which are not already the default, and to validate NVs being
+ * set so APP_nvDefault() and APP_nvValidate() are not used. If NV_CACHE is
+ * defined a volatile NV is only held in the cache and starts with its default
+ * at power up, otherwise it is treated as any other NV. NVRQD NN index requests an NVDSC NN index default min 
+ * max flags describing the NV, or all of the NVs if index is 0. 
+ * For example:
+ * <pre>
+ * const NvDescriptor nvDescriptors[] = {
+ *     NV_RANGE(10, 1, 100),        // NV1
+ *     NV_BITS(0x00, 0x0F),         // NV2
+ *     NV_VOLATILE(0, 0, 255),      // NV3
+ *     ...
+ * };
+ * NV_DESCRIPTORS_CHECK;
+ * </pre>
+ * 
+ * The NVRQD and NVDSC opcodes are PROVISIONAL in the same way as the bulk 
+ * opcodes, so NV_DESCRIPTORS is off unless defined. Each opcode may be changed
+ * in module.h.
+ * 
  * # Dependencies on other Services
  * Although the NV service does not depend upon any other services all modules
  * must include the MNS service.
@@ -63,15 +109,26 @@
  * - #define NV_CACHE     Defined, as opposed to undefined, to enable a cache of
  *                      NVs in RAM. Uses more RAM but speeds up access to NVs when
  *                      in normal operation processing events. 
+ * - #define NV_WRITE_BACK Optional, requires NV_CACHE. Defer and combine the 
+ *                      writes of NVs to NVM.
+ * - #define NV_FLUSH_DELAY Optional. The time without an NV being changed 
+ *                      before the changes are written. Defaults to ONE_SECOND.
+ * - #define NV_BULK      Optional, experimental. Support the provisional bulk
+ *                      NV read and write opcodes.
+ * - #define NV_DESCRIPTORS Optional, experimental. Use the application's 
+ *                      nvDescriptors[] table for the NV defaults and validation
+ *                      and support the provisional description opcodes.
  * - #define NV_ADDRESS   the address in non volatile memory to place the NVM version 
  *                      number and NVs if the NV service is included.
  * - #define NV_NVM_TYPE  the type of NVM memory to be used for NVs. Can be either
  *                      EEPROM_NVM_TYPE or FLASH_NVM_TYPE.
  * - Function uint8_t APP_nvDefault(uint8_t index) The application must implement this 
- *                      function to provide factory default values for NVs.
+ *                      function to provide factory default values for NVs,
+ *                      unless NV_DESCRIPTORS is defined.
  * - Function NvValidation APP_nvValidate(uint8_t index, uint8_t value) The application
  *                      must implement this function in order to validate that
- *                      the value being written to an NV is valid.
+ *                      the value being written to an NV is valid, unless
+ *                      NV_DESCRIPTORS is defined.
  * - Function void APP_nvValueChanged(uint8_t index, uint8_t newValue, uint8_t oldValue)
  *                      The application must implement this function in order to
  *                      perform any needed functionality to be performed when an 
@@ -98,9 +155,86 @@ typedef enum NvValidation {
  */
 extern NvValidation APP_nvValidate(uint8_t index, uint8_t value);
 
+/*
+ * Get the value of an NV.
+ * @param index the NV index
+ * @return the NV value, NV_NUM for index 0 or -CMDERR_INV_NV_IDX if the index is out of range
+ */
+extern int16_t getNV(uint8_t index);
+
+/*
+ * Write all changed NVs to NVM now, for example before a reset. Only 
+ * available if NV_WRITE_BACK is defined.
+ */
+extern void flushNVs(void);
+
+#ifdef NV_BULK
+/* 
+ * The bulk NV opcodes. PROVISIONAL: not allocated by the MERGLCB specification,
+ * may be changed in module.h.
+ */
+#ifndef OPC_NVWRB
+#define OPC_NVWRB   0x8C    ///< start a block write, NN first count
+#endif
+#ifndef OPC_NVRDB
+#define OPC_NVRDB   0x8D    ///< read a block, NN first count
+#endif
+#ifndef OPC_NVANB
+#define OPC_NVANB   0xEC    ///< part of a block read, NN index v0 v1 v2 v3
+#endif
+#ifndef OPC_NVSETB
+#define OPC_NVSETB  0xED    ///< part of a block write, NN index v0 v1 v2 v3
+#endif
+#define NV_BULK_PER_FRAME   4   ///< the number of NVs in a NVANB/NVSETB
+#endif
+
+#ifdef NV_DESCRIPTORS
+/* 
+ * The NV description opcodes. PROVISIONAL: not allocated by the MERGLCB 
+ * specification, may be changed in module.h.
+ */
+#ifndef OPC_NVRQD
+#define OPC_NVRQD   0x7C    ///< request the description of an NV, NN index
+#endif
+#ifndef OPC_NVDSC
+#define OPC_NVDSC   0xEE    ///< description of an NV, NN index default min max flags
+#endif
+
+/**
+ * The description of an NV.
+ */
+typedef struct {
+    uint8_t defaultValue;   ///< the factory default
+    uint8_t min;            ///< the lowest value allowed
+    uint8_t max;            ///< the highest value allowed, or the bits allowed with NV_FLAG_BITMASK
+    uint8_t flags;
+} NvDescriptor;
+
+#define NV_FLAG_BITMASK     0x01    ///< max is a mask of the bits which may be set
+#define NV_FLAG_VOLATILE    0x02    ///< the NV is not saved in NVM
+
+/* Helpers to fill in the nvDescriptors[] table */
+#define NV_RANGE(def, min, max)     {(def), (min), (max), 0}
+#define NV_BITS(def, mask)          {(def), 0, (mask), NV_FLAG_BITMASK}
+#define NV_VOLATILE(def, min, max)  {(def), (min), (max), NV_FLAG_VOLATILE}
+
+/**
+ * The application must provide a description of each NV, the first entry 
+ * being for NV1.
+ */
+extern const NvDescriptor nvDescriptors[];
+
+/**
+ * Placed after the nvDescriptors[] table so that the compiler reports an 
+ * error unless there is exactly one entry for each NV.
+ */
+#define NV_DESCRIPTORS_CHECK    typedef char nvDescriptorsCheck[(sizeof(nvDescriptors) == NV_NUM*sizeof(NvDescriptor)) ? 1 : -1]
+#endif
+
 /* The list of the diagnostics supported */
-#define NUM_NV_DIAGNOSTICS 2    ///< The number of diagnostics supported by this service
+#define NUM_NV_DIAGNOSTICS 3    ///< The number of diagnostics supported by this service
 #define NV_DIAGNOSTICS_NUM_ACCESS  0x00    ///< return Global status Byte.
 #define NV_DIAGNOSTICS_NUM_FAIL    0x01    ///< return uptime upper word.
+#define NV_DIAGNOSTICS_WRITES_SAVED 0x02   ///< number of NV writes to NVM avoided
 
 #endif
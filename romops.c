@@ -52,41 +52,104 @@
  * This involves needing to erase a block if changing any bit from 0 to 1 and
  * if changing a single byte the entire block must be read, the byte changed 
  * and the entire block written back.
+ * 
+ * To reduce the number of erases and writes, FLASH_CACHE_BLOCKS blocks are 
+ * held in RAM. Changes are made to the copy in RAM and a block is only written
+ * back when its space is needed for another block, the least recently used 
+ * block being replaced, when flushFlashBlock() is called or when there have
+ * been no flash writes for FLASH_IDLE_FLUSH.
+ * 
+ * If EEPROM_WRITE_QUEUE_SIZE is defined EEPROM writes are queued and written 
+ * in the background, each write being started by the EEPROM write complete 
+ * interrupt, so the CPU is not held up for the 4ms each byte takes.
  */
 
 #include <xc.h>
 #include "merglcb.h"
+#include "module.h"
 #include "hardware.h"
 #include "romops.h"
 #include "mns.h"
+#include "ticktime.h"
 
 #ifdef _PIC18
 #define BLOCK_SIZE _FLASH_ERASE_SIZE
 #endif
 
-// Structure for tracking Flash operations
-static union
-{
-    uint8_t asByte;       
-    struct  {
-        uint8_t writeNeeded:1; //flag if buffer is modified
-        uint8_t eraseNeeded:1;  //flag if long write with block erase
-    };
-} flashFlags;
-static uint8_t     flashBuffer[BLOCK_SIZE];    // Assumes that Erase and Write are the same size
-static uint24_t    flashBlock;     //address of current 64 byte flash block
+/**
+ * The number of flash blocks held in RAM, each using BLOCK_SIZE bytes. May be
+ * overridden in module.h.
+ */
+#ifndef FLASH_CACHE_BLOCKS
+#define FLASH_CACHE_BLOCKS  1
+#endif
+/**
+ * Changed blocks are written to flash once there have been no flash writes
+ * for this time. May be overridden in module.h.
+ */
+#ifndef FLASH_IDLE_FLUSH
+#define FLASH_IDLE_FLUSH    (2*ONE_SECOND)
+#endif
+
+// Structure for tracking a block of flash held in RAM
+typedef struct {
+    uint24_t block;             // address of the flash block
+    uint16_t lastUsed;          // flashUseCount when last accessed
+    union {
+        uint8_t asByte;       
+        struct  {
+            uint8_t writeNeeded:1;  //flag if buffer is modified
+            uint8_t eraseNeeded:1;  //flag if long write with block erase
+            uint8_t inUse:1;        //flag if the buffer holds a block
+        };
+    } flags;
+} FlashCacheBlock;
+static FlashCacheBlock flashCache[FLASH_CACHE_BLOCKS];
+static uint8_t     flashBuffers[FLASH_CACHE_BLOCKS][BLOCK_SIZE];   // Assumes that Erase and Write are the same size
+static uint16_t    flashUseCount;
+static uint8_t     flashLastIndex;     // the most recently used cache entry
+static Boolean     flashWritePending;  // there may be blocks to write
+static TickValue   flashWriteTime;     // time of the last write
+uint16_t flashEraseCount;
+uint16_t flashWriteCount;
+
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+// An EEPROM write waiting to be written
+typedef struct {
+    uint16_t index;
+    uint8_t value;
+} EepromWrite;
+static EepromWrite eepromQueue[EEPROM_WRITE_QUEUE_SIZE];
+static volatile uint8_t eepromQueueHead;    // the write in progress
+static volatile uint8_t eepromQueueCount;   // the number of writes not yet finished
+static volatile uint8_t eepromErrors;       // failed writes not yet reported
+
+// Stop background EEPROM writes using the NVM registers during a flash write
+#define EEPROM_HOLD()       {PIE4bits.EEIE = 0; while (EECON1bits.WR);}
+#define EEPROM_RELEASE()    {PIE4bits.EEIE = (eepromQueueCount != 0);}
+#else
+#define EEPROM_HOLD()
+#define EEPROM_RELEASE()
+#endif
 
 #define BLOCK(A)    (A&(uint24_t)(~(BLOCK_SIZE-1)))
 #define OFFSET(A)   (A&(BLOCK_SIZE-1))
 
+static uint8_t findFlashBlock(uint24_t block);
+static uint8_t getFlashBlock(uint24_t block);
+static void eraseFlashBlock(uint24_t block);
+static void writeFlashBlock(uint8_t cacheIndex);
+static void loadFlashBlock(uint8_t cacheIndex);
+
 
 
 /**
- * Read EEPROM.  
+ * Read a byte directly from EEPROM, waiting for any write in progress to 
+ * finish.
  * @param index the address
  * @return the value
  */
-int16_t read_eeprom(uint16_t index) {
+static uint8_t readEepromByte(uint16_t index) {
     // do read of EEPROM
     while (EECON1bits.WR)       // Errata says this is required
         ;
@@ -104,6 +167,173 @@ int16_t read_eeprom(uint16_t index) {
     return EEDATA;
 }
 
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+/**
+ * Find the newest queued write to an address. The write in progress is 
+ * included only if includeHead is set.
+ * Must be called with the EEPROM interrupt disabled.
+ * @param index the address
+ * @param includeHead whether to include the write in progress
+ * @return the position in eepromQueue or EEPROM_WRITE_QUEUE_SIZE if not found
+ */
+static uint8_t findEepromWrite(uint16_t index, Boolean includeHead) {
+    uint8_t n;
+    uint8_t pos;
+    
+    for (n=eepromQueueCount; n > (includeHead ? 0 : 1); n--) {
+        pos = eepromQueueHead + n - 1;
+        if (pos >= EEPROM_WRITE_QUEUE_SIZE) pos -= EEPROM_WRITE_QUEUE_SIZE;
+        if (eepromQueue[pos].index == index) {
+            return pos;
+        }
+    }
+    return EEPROM_WRITE_QUEUE_SIZE;
+}
+
+/**
+ * Start the hardware writing the write at the head of the queue. Interrupts are
+ * only disabled for the unlock sequence.
+ */
+static void startEepromWrite(void) {
+    uint8_t gieh;
+    uint8_t giel;
+    
+    SET_EADDRH((eepromQueue[eepromQueueHead].index >> 8)&0xFF);
+    EEADR = eepromQueue[eepromQueueHead].index & 0xFF;
+    EEDATA = eepromQueue[eepromQueueHead].value;
+    EECON1bits.EEPGD = 0;       /* Point to DATA memory */
+    EECON1bits.CFGS = 0;        /* Access program FLASH/Data EEPROM memory */
+    EECON1bits.WREN = 1;        /* Enable writes */
+    EEIF = 0;
+    // may be within the low priority ISR so restore each level separately
+    gieh = INTCONbits.GIEH;
+    giel = INTCONbits.GIEL;
+    bothDi();
+    EECON2 = 0x55;
+    EECON2 = 0xAA;
+    EECON1bits.WR = 1;
+    INTCONbits.GIEL = giel;
+    INTCONbits.GIEH = gieh;
+    EECON1bits.WREN = 0;        /* Disable writes, the write carries on */
+}
+
+/**
+ * Called once the write at the head of the queue has finished. Checks the 
+ * byte written, retrying if it is wrong, and starts the next write.
+ * Must be called with the EEPROM interrupt disabled.
+ */
+static void eepromWriteDone(void) {
+    if (readEepromByte(eepromQueue[eepromQueueHead].index) == eepromQueue[eepromQueueHead].value) {
+        eepromQueueHead++;
+        if (eepromQueueHead >= EEPROM_WRITE_QUEUE_SIZE) eepromQueueHead = 0;
+        eepromQueueCount--;
+    } else {
+        eepromErrors++;     // reported by pollRomOps()
+    }
+    if (eepromQueueCount) {
+        startEepromWrite();
+    }
+}
+
+/**
+ * Wait for the write in progress to finish and then process its completion.
+ * Must be called with the EEPROM interrupt disabled.
+ */
+static void finishEepromWrite(void) {
+    while (EECON1bits.WR)
+        ;
+    while (!EEIF)
+        ;
+    EEIF = 0;
+    eepromWriteDone();
+}
+
+/**
+ * Read EEPROM. Values waiting in the write queue are returned in preference to
+ * the EEPROM contents.
+ * @param index the address
+ * @return the value
+ */
+int16_t read_eeprom(uint16_t index) {
+    uint8_t pos;
+    int16_t value;
+    
+    PIE4bits.EEIE = 0;  // stop the ISR changing the queue or EEPROM registers
+    pos = findEepromWrite(index, TRUE);
+    if (pos < EEPROM_WRITE_QUEUE_SIZE) {
+        value = eepromQueue[pos].value;
+    } else {
+        value = readEepromByte(index);
+    }
+    PIE4bits.EEIE = (eepromQueueCount != 0);
+    return value;
+}
+
+/**
+ * Write a byte to EEPROM. The write is added to the queue and returns 
+ * immediately, the queue being written in the background by eepromIsr(). A 
+ * further change to an address already waiting in the queue replaces the 
+ * queued value. Only if the queue is full does this wait for a write to finish.
+ * @param index the address
+ * @param value the value to be written
+ * @return 0 for success or error otherwise
+ */
+uint8_t write_eeprom(uint16_t index, uint8_t value) {
+    uint8_t pos;
+    
+    PIE4bits.EEIE = 0;  // stop the ISR changing the queue or EEPROM registers
+    pos = findEepromWrite(index, FALSE);
+    if (pos < EEPROM_WRITE_QUEUE_SIZE) {
+        eepromQueue[pos].value = value;
+    } else {
+        while (eepromQueueCount >= EEPROM_WRITE_QUEUE_SIZE) {
+            finishEepromWrite();
+        }
+        pos = eepromQueueHead + eepromQueueCount;
+        if (pos >= EEPROM_WRITE_QUEUE_SIZE) pos -= EEPROM_WRITE_QUEUE_SIZE;
+        eepromQueue[pos].index = index;
+        eepromQueue[pos].value = value;
+        eepromQueueCount++;
+        if (eepromQueueCount == 1) {
+            startEepromWrite();
+        }
+    }
+    PIE4bits.EEIE = 1;
+    return GRSP_OK;
+}
+
+/**
+ * Write all the queued EEPROM writes, waiting until they are finished. Must 
+ * be called before a reset so that writes are not lost.
+ */
+void flushEeprom(void) {
+    PIE4bits.EEIE = 0;
+    while (eepromQueueCount) {
+        finishEepromWrite();
+    }
+}
+
+/**
+ * Handle the EEPROM write complete interrupt. Called from the low priority ISR.
+ */
+void eepromIsr(void) {
+    if (PIE4bits.EEIE && EEIF) {
+        EEIF = 0;
+        eepromWriteDone();
+        PIE4bits.EEIE = (eepromQueueCount != 0);
+    }
+}
+
+#else
+/**
+ * Read EEPROM.  
+ * @param index the address
+ * @return the value
+ */
+int16_t read_eeprom(uint16_t index) {
+    return readEepromByte(index);
+}
+
 /**
  * Write a byte to EEPROM
  * @param index the address
@@ -136,7 +366,7 @@ uint8_t write_eeprom(uint16_t index, uint8_t value) {
             bothEi();                  
         }
         EECON1bits.WREN = 0;		/* Disable writes */
-        if (read_eeprom(index) == value) {
+        if (readEepromByte(index) == value) {
             // it is ok
             break;
         }
@@ -146,6 +376,58 @@ uint8_t write_eeprom(uint16_t index, uint8_t value) {
     
     return GRSP_OK;
 }
+#endif
+
+/**
+ * Find a block in the flash cache.
+ * @param block the address of the block
+ * @return the index into the cache or FLASH_CACHE_BLOCKS if not held
+ */
+static uint8_t findFlashBlock(uint24_t block) {
+    uint8_t i;
+    
+    if (flashCache[flashLastIndex].flags.inUse && (flashCache[flashLastIndex].block == block)) {
+        return flashLastIndex;
+    }
+    for (i=0; i<FLASH_CACHE_BLOCKS; i++) {
+        if (flashCache[i].flags.inUse && (flashCache[i].block == block)) {
+            flashLastIndex = i;
+            return i;
+        }
+    }
+    return FLASH_CACHE_BLOCKS;
+}
+
+/**
+ * Get a block into the flash cache, writing back the least recently used 
+ * block if there is no free space.
+ * @param block the address of the block
+ * @return the index into the cache
+ */
+static uint8_t getFlashBlock(uint24_t block) {
+    uint8_t i;
+    uint8_t victim;
+    
+    i = findFlashBlock(block);
+    if (i < FLASH_CACHE_BLOCKS) {
+        return i;
+    }
+    victim = 0;
+    for (i=0; i<FLASH_CACHE_BLOCKS; i++) {
+        if ( ! flashCache[i].flags.inUse) {
+            victim = i;
+            break;
+        }
+        if ((uint16_t)(flashUseCount - flashCache[i].lastUsed) > (uint16_t)(flashUseCount - flashCache[victim].lastUsed)) {
+            victim = i;
+        }
+    }
+    writeFlashBlock(victim);
+    flashCache[victim].block = block;
+    loadFlashBlock(victim);
+    flashLastIndex = victim;
+    return victim;
+}
 
 /**
  * Read Flash. 
@@ -153,10 +435,14 @@ uint8_t write_eeprom(uint16_t index, uint8_t value) {
  * @return the value
  */
 int16_t read_flash(uint24_t index) {
+    uint8_t i;
+    
     // do read of Flash
-    if (BLOCK(index) == flashBlock) {
-        // if the block is the current one then get it directly
-        return flashBuffer[OFFSET(index)];
+    i = findFlashBlock(BLOCK(index));
+    if (i < FLASH_CACHE_BLOCKS) {
+        // if the block is held then get it directly
+        flashCache[i].lastUsed = ++flashUseCount;
+        return flashBuffers[i][OFFSET(index)];
     } else {
         // we'll read single byte from flash
         TBLPTR = index;
@@ -166,19 +452,52 @@ int16_t read_flash(uint24_t index) {
     }
 }
 
+/**
+ * Read a number of consecutive bytes of Flash. The table pointer is set once 
+ * and then auto-incremented. Any bytes within blocks held in the flash cache
+ * are taken from the cache as they may not yet have been written.
+ * @param index the address of the first byte
+ * @param buffer where the bytes are to be put
+ * @param len the number of bytes
+ */
+static void read_flash_block(uint24_t index, uint8_t * buffer, uint8_t len) {
+    uint8_t i;
+    uint8_t c;
+    uint24_t block;
+    
+    TBLPTR = index;
+    TBLPTRU = 0;
+    for (i=0; i<len; i++) {
+        asm("TBLRD*+");
+        buffer[i] = TABLAT;
+    }
+    for (c=0; c<FLASH_CACHE_BLOCKS; c++) {
+        if ( ! flashCache[c].flags.inUse) continue;
+        block = flashCache[c].block;
+        if ((block + BLOCK_SIZE <= index) || (block >= index + len)) continue;
+        for (i=0; i<len; i++) {
+            if (BLOCK(index+i) == block) {
+                buffer[i] = flashBuffers[c][OFFSET(index+i)];
+            }
+        }
+    }
+}
+
 /**
  * Erase a block of flash.
  * May block awaiting for the application to indicate that it is a suitable time
  * to allow the CPU to be halted.
+ * @param block the address of the block
  */
-void eraseFlashBlock(void) {
+static void eraseFlashBlock(uint24_t block) {
     uint8_t interruptEnabled;
     // Call back into the application to check if now is a good time to write the flash
     // as the processor will be suspended for up to 2ms.
     while (! APP_isSuitableTimeToWriteFlash());
     
+    EEPROM_HOLD();
     interruptEnabled = geti(); // store current global interrupt state
-    TBLPTR = flashBlock;
+    TBLPTR = block;
     TBLPTRU = 0;
     EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
     EECON1bits.CFGS = 0;    // 0=Program memory/EEPROM, 1=ConfigBits
@@ -194,25 +513,32 @@ void eraseFlashBlock(void) {
         bothEi();                   /* Enable Interrupts */
     }
     EECON1bits.WREN = 0;    // disable write to memory
+    EEPROM_RELEASE();
+    flashEraseCount++;
 }
 
 /**
- * Flush the current flash buffer out to flash.
+ * Write a block held in the flash cache out to flash, if it has been changed.
  * Will suspend the CPU.
+ * @param cacheIndex the index into the flash cache
  */
-void flushFlashBlock(void) {
+static void writeFlashBlock(uint8_t cacheIndex) {
     uint8_t interruptEnabled;
-    TBLPTR = flashBlock; //force row boundary
-    TBLPTRU = 0;
-    if (! flashFlags.writeNeeded) return;
-    if (flashFlags.eraseNeeded) {
-        eraseFlashBlock();
+    FlashCacheBlock * c;
+    
+    c = &(flashCache[cacheIndex]);
+    if (! c->flags.writeNeeded) return;
+    if (c->flags.eraseNeeded) {
+        eraseFlashBlock(c->block);
     }
+    EEPROM_HOLD();
+    TBLPTR = c->block; //force row boundary
+    TBLPTRU = 0;
     
     interruptEnabled = geti(); // store current global interrupt state
     bothDi();     // disable all interrupts ERRATA says this is needed before TBLWT
     for (unsigned char i=0; i<BLOCK_SIZE; i++) {
-        TABLAT = flashBuffer[i];
+        TABLAT = flashBuffers[cacheIndex][i];
         asm("TBLWT*+");
     }
     // Note from data sheet: 
@@ -221,7 +547,7 @@ void flushFlashBlock(void) {
     //   intended address range of the 64 bytes in
     //   the holding register.
     // So we put it back into the block here
-    TBLPTR = flashBlock;
+    TBLPTR = c->block;
     TBLPTRU = 0;
     EECON1bits.EEPGD = 1;   // 1=Program memory, 0=EEPROM
     EECON1bits.CFGS = 0;    // 0=ProgramMemory/EEPROM, 1=ConfigBits
@@ -235,24 +561,70 @@ void flushFlashBlock(void) {
         bothEi();                   /* Enable Interrupts */
     }
     EECON1bits.WREN = 0;
-    flashFlags.asByte = 0;  // no erase, no write
+    EEPROM_RELEASE();
+    c->flags.writeNeeded = 0;   // no erase, no write
+    c->flags.eraseNeeded = 0;
+    flashWriteCount++;
+}
+
+/**
+ * Flush all the changed blocks in the flash cache out to flash.
+ * Will suspend the CPU.
+ */
+void flushFlashBlock(void) {
+    uint8_t i;
+    
+    for (i=0; i<FLASH_CACHE_BLOCKS; i++) {
+        writeFlashBlock(i);
+    }
+    flashWritePending = FALSE;
 }
 
 /**
- * Load an entire block of flash into the flash buffer.
+ * Write back one changed block once there have been no flash writes for 
+ * FLASH_IDLE_FLUSH. Also reports any failed EEPROM writes. To be called 
+ * regularly.
  */
-void loadFlashBlock(void) {
+void pollRomOps(void) {
+    uint8_t i;
+    
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+    while (eepromErrors) {
+        eepromErrors--;
+        mnsDiagnostics[MNS_DIAGNOSTICS_MEMERRS].asUint++;
+        updateModuleErrorStatus();
+    }
+#endif
+    if ( ! flashWritePending) return;
+    if (tickTimeSince(flashWriteTime) < FLASH_IDLE_FLUSH) return;
+    for (i=0; i<FLASH_CACHE_BLOCKS; i++) {
+        if (flashCache[i].flags.writeNeeded) {
+            // one block at a time so as not to hold up the CPU for long
+            writeFlashBlock(i);
+            return;
+        }
+    }
+    flashWritePending = FALSE;
+}
+
+/**
+ * Load an entire block of flash into the flash cache.
+ * @param cacheIndex the index into the flash cache, the block address must
+ * already be set
+ */
+static void loadFlashBlock(uint8_t cacheIndex) {
     EECON1=0X80;    // access to flash
-    TBLPTR = flashBlock;
+    TBLPTR = flashCache[cacheIndex].block;
     TBLPTRU = 0;
-    for (uint8_t i=0; i<64; i++) {
+    for (uint8_t i=0; i<BLOCK_SIZE; i++) {
         asm("TBLRD*+");
         NOP();
-        flashBuffer[i] = TABLAT;
+        flashBuffers[cacheIndex][i] = TABLAT;
     }
-    TBLPTR = flashBlock;
+    TBLPTR = flashCache[cacheIndex].block;
     TBLPTRU = 0;
-    flashFlags.asByte = 0; // no erase, no write needed
+    flashCache[cacheIndex].flags.asByte = 0; // no erase, no write needed
+    flashCache[cacheIndex].flags.inUse = 1;
 }
    
 /**
@@ -264,6 +636,7 @@ void loadFlashBlock(void) {
  * @return 0 for success or error otherwise
  */
 uint8_t write_flash(uint24_t index, uint8_t value) {
+    uint8_t i;
     uint8_t oldValue;
     
     while (APP_isSuitableTimeToWriteFlash() == BAD_TIME)  // block awaiting a good time
@@ -276,29 +649,24 @@ uint8_t write_flash(uint24_t index, uint8_t value) {
      * too many writes to happen and the flash would wear out.
      * Instead after reading the block and updating the byte we don't write the
      * buffer back in case there is another update within the same block. The 
-     * block is only written back if another block needs to be updated.
+     * block is only written back if its buffer is needed for another block, or
+     * when flushed.
      * Whilst writing back if any bit changes from 0 to 1 then the block needs
      * to be erased before writing.
      *
      */
-    if (BLOCK(index) != flashBlock) {
-        // ok we want to write a different block so flush the current block 
-        if (flashFlags.eraseNeeded) {
-            eraseFlashBlock();
-            flashFlags.eraseNeeded = 0;
+    i = getFlashBlock(BLOCK(index));
+    flashCache[i].lastUsed = ++flashUseCount;
+    oldValue = flashBuffers[i][OFFSET(index)];
+    if (oldValue != value) {
+        if (value & ~oldValue) {
+            flashCache[i].flags.eraseNeeded = 1;
         }
-        
-        flushFlashBlock();
-        
-        // and load the new one
-        flashBlock = BLOCK(index);
-        loadFlashBlock();
-    }
-    flashFlags.eraseNeeded = (value & ~flashBuffer[OFFSET(index)])?1:0;
-    if (flashBuffer[OFFSET(index)] != value) {
-        flashFlags.writeNeeded = 1;
-        flashBuffer[OFFSET(index)] = value;
+        flashCache[i].flags.writeNeeded = 1;
+        flashBuffers[i][OFFSET(index)] = value;
+        flashWritePending = TRUE;
     }
+    flashWriteTime.val = tickGet();
     return GRSP_OK;
 }
 
@@ -337,13 +705,52 @@ int16_t readNVM(NVMtype type, uint24_t index) {
     }
 }
 
+/**
+ * Read a number of consecutive bytes of NVM. Quicker than calling readNVM()
+ * for each byte.
+ * @param type the type of memory to be accessed
+ * @param index the address of the first byte
+ * @param buffer where the bytes are to be put
+ * @param len the number of bytes to read
+ * @return 0 for success, error otherwise
+ */
+uint8_t readNVMBlock(NVMtype type, uint24_t index, uint8_t * buffer, uint8_t len) {
+    switch(type) {
+        case EEPROM_NVM_TYPE:
+            while (len--) {
+                *buffer++ = (uint8_t)read_eeprom((uint16_t)index++);
+            }
+            return GRSP_OK;
+        case FLASH_NVM_TYPE:
+            if (len) {
+                read_flash_block(index, buffer, len);
+            }
+            return GRSP_OK;
+        default:
+            return GRSP_UNKNOWN_NVM_TYPE;
+    }
+}
+
 /**
  *  Initialise variables for Flash program tracking.
  */
 void initRomOps(void) {
-    flashFlags.asByte = 0;  // no write and no erase
-    flashBlock = 0x0000; // invalid but as long a write isn't needed it will be 
-                         // ok. Next write will always be to a different block.
+    uint8_t i;
+    
+    for (i=0; i<FLASH_CACHE_BLOCKS; i++) {
+        flashCache[i].flags.asByte = 0;  // not in use, no write and no erase
+    }
+    flashLastIndex = 0;
+    flashWritePending = FALSE;
+    flashEraseCount = 0;
+    flashWriteCount = 0;
+#ifdef EEPROM_WRITE_QUEUE_SIZE
+    PIE4bits.EEIE = 0;
+    IPR4bits.EEIP = 0;  // low priority
+    eepromQueueHead = 0;
+    eepromQueueCount = 0;
+    eepromErrors = 0;
+#endif
     TBLPTRU = 0;
 }
 
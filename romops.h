@@ -56,6 +56,28 @@
  * This involves needing to erase a block if changing any bit from 0 to 1 and
  * if changing a single byte the entire block must be read, the byte changed 
  * and the entire block written back.
+ * 
+ * Blocks being changed are held in RAM and only written back when the space 
+ * is needed for another block, when flushFlashBlock() is called or, by 
+ * pollRomOps(), when there have been no flash writes for a while. Holding more
+ * than one block avoids repeatedly erasing and writing blocks when changes 
+ * alternate between blocks.
+ * 
+ * If EEPROM_WRITE_QUEUE_SIZE is defined writes to EEPROM are queued and return
+ * immediately. The queue is written by eepromIsr(), which the MERGLCB low 
+ * priority ISR calls, one byte per EEPROM write complete interrupt. Reads 
+ * return the queued value of an address still waiting to be written. 
+ * flushEeprom() waits for all the queued writes to finish and must be called
+ * before a reset. If the queue is full a write waits for space.
+ * 
+ * # Module.h definitions
+ * - #define FLASH_CACHE_BLOCKS Optional. The number of flash blocks held in RAM,
+ *                      each using _FLASH_ERASE_SIZE bytes. Defaults to 1.
+ * - #define FLASH_IDLE_FLUSH Optional. The time without flash writes before 
+ *                      changed blocks are written. Defaults to 2*ONE_SECOND.
+ * - #define EEPROM_WRITE_QUEUE_SIZE Optional. The number of EEPROM writes 
+ *                      which can be queued, 3 bytes each. If not defined 
+ *                      EEPROM writes wait until the byte has been written.
  */
 
 // NVM types
@@ -86,8 +108,35 @@ typedef enum ValidTime {
 
 
 
+/*
+ * Write all changed flash blocks to flash.
+ */
 extern void flushFlashBlock(void);
 
+/*
+ * Write changed flash blocks once flash writes have stopped. Called from the 
+ * MERGLCB poll.
+ */
+extern void pollRomOps(void);
+
+/*
+ * Write all the queued EEPROM writes, waiting until they are finished. Only
+ * available if EEPROM_WRITE_QUEUE_SIZE is defined.
+ */
+extern void flushEeprom(void);
+
+/*
+ * Handle the EEPROM write complete interrupt. Called from the low priority ISR.
+ * Only available if EEPROM_WRITE_QUEUE_SIZE is defined.
+ */
+extern void eepromIsr(void);
+
+/*
+ * The number of flash block erases and writes since power up.
+ */
+extern uint16_t flashEraseCount;
+extern uint16_t flashWriteCount;
+
 /*
  * Initialise the Romops functions. Sets the flash buffer as being currently unused. 
  */
@@ -101,6 +150,16 @@ extern void initRomOps(void);
  */
 extern int16_t readNVM(NVMtype type, uint24_t index);
 
+/*
+ * Read a number of consecutive bytes from NVM.
+ * @param type specify the type of NVM required
+ * @param index is the address of the first byte to be read
+ * @param buffer where the bytes are to be put
+ * @param len the number of bytes to be read
+ * @return 0 for success or error number
+ */
+extern uint8_t readNVMBlock(NVMtype type, uint24_t index, uint8_t * buffer, uint8_t len);
+
 /*
  * Write a byte to NVM.
  * @param type specify the type of NVM required
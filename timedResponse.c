@@ -45,32 +45,106 @@
  * startTimedResponse() is to be called to start the transmission. A callback
  * function is provided and that function is called with an incrementing step 
  * value. The function must return a result to indicate that it has finished or 
- * that it still has more work to do.
+ * that it still has more work to do. A callback which had nothing to send for
+ * a step may return TIMED_RESPONSE_RESULT_SKIP so that the next step is done
+ * straight away rather than waiting for the next poll. A callback can also 
+ * jump directly to a later step using seekTimedResponse().
  * 
- * Only one set of timedResponse can be running at a time. If a second 
- * timedResponse is started then the first will be abandoned and replaced
- * by the new one.
+ * Up to NUM_TIMED_RESPONSE_SESSIONS sets of timedResponse can be running at 
+ * the same time, each with its own type, service index and step. The sessions
+ * are serviced round-robin, one step per call of pollTimedResponse(), so the 
+ * overall rate of messages is the same as for a single session.
+ * If a timedResponse is started with the same type, service and callback as
+ * one already running then the running one is restarted from step 0. If all
+ * sessions are in use then the oldest session is abandoned and replaced by
+ * the new one.
  * 
  * Call initTimedResponse() before other TimedResponse processing. 
- * This will set the current response set to be None.
+ * This will set all the sessions to be None.
  * Call pollTimedResponse() on a regular basis which will do the work needed for 
  * the next step and increments the step counter.
  * 
  * To start send a set of timed responses call startTimedResponse specifying
  * the callback.
  */
-static uint8_t timedResponseServiceIndex;
-static uint8_t timedResponseAllServicesFlag;
-static uint8_t timedResponseType;
-static uint8_t timedResponseStep;
-static TimedResponseResult (*timedResponseCallback)(uint8_t type, uint8_t serviceIndex, uint8_t step);
+
+/**
+ * The number of timedResponse sessions which can be in progress at once. May 
+ * be overridden in module.h.
+ */
+#ifndef NUM_TIMED_RESPONSE_SESSIONS
+#define NUM_TIMED_RESPONSE_SESSIONS 3
+#endif
+
+/**
+ * The state of a single set of timed responses.
+ */
+typedef struct {
+    uint8_t type;               // TIMED_RESPONSE_NONE if the session is free
+    uint8_t serviceIndex;
+    uint8_t allServicesFlag;
+    uint8_t step;
+    uint8_t startOrder;         // used to find the oldest session
+    TimedResponseResult (*callback)(uint8_t type, uint8_t serviceIndex, uint8_t step);
+} TimedResponseSession;
+
+static TimedResponseSession timedResponseSessions[NUM_TIMED_RESPONSE_SESSIONS];
+static uint8_t timedResponseNextSession;    // round-robin position
+static uint8_t timedResponseStartCount;
+static TimedResponseSession * currentSession; // session whose callback is running
 
 
 /**
  * Initialise the timedResponse functionality.
  */
 void initTimedResponse(void) {
-    timedResponseType = TIMED_RESPONSE_NONE;
+    uint8_t i;
+    for (i=0; i<NUM_TIMED_RESPONSE_SESSIONS; i++) {
+        timedResponseSessions[i].type = TIMED_RESPONSE_NONE;
+    }
+    timedResponseNextSession = 0;
+    timedResponseStartCount = 0;
+    currentSession = NULL;
+}
+
+/**
+ * Find the session to be used for a new set of timed responses. A running
+ * session for the same request is reused, otherwise a free session is used or,
+ * if none are free, the oldest session.
+ * @param type the type of the callback
+ * @param serviceIndex the service index as passed to startTimedResponse
+ * @param callback the callback function
+ * @return the session to use
+ */
+static TimedResponseSession * allocateSession(uint8_t type, uint8_t serviceIndex, TimedResponseResult (*callback)(uint8_t type, uint8_t si, uint8_t step)) {
+    uint8_t i;
+    TimedResponseSession * s;
+    TimedResponseSession * freeSession = NULL;
+    TimedResponseSession * oldestSession = timedResponseSessions;
+    
+    for (i=0; i<NUM_TIMED_RESPONSE_SESSIONS; i++) {
+        s = &(timedResponseSessions[i]);
+        if (s->type == TIMED_RESPONSE_NONE) {
+            if (freeSession == NULL) {
+                freeSession = s;
+            }
+            continue;
+        }
+        if ((s->type == type) && (s->callback == callback)) {
+            if (serviceIndex == SERVICE_ID_ALL) {
+                if (s->allServicesFlag) return s;
+            } else if (( ! s->allServicesFlag) && (s->serviceIndex == serviceIndex-1)) {
+                return s;
+            }
+        }
+        if ((uint8_t)(timedResponseStartCount - s->startOrder) > (uint8_t)(timedResponseStartCount - oldestSession->startOrder)) {
+            oldestSession = s;
+        }
+    }
+    if (freeSession != NULL) {
+        return freeSession;
+    }
+    return oldestSession;
 }
 
 /**
@@ -82,64 +156,126 @@ void initTimedResponse(void) {
  * @param callback the user specific callback function
  */
 void startTimedResponse(uint8_t type, uint8_t serviceIndex, TimedResponseResult (*callback)(uint8_t type, uint8_t si, uint8_t step)) {
-    timedResponseType = type;
-    if (serviceIndex == SERVICE_ID_ALL) { 
-        // go through all the services
-        timedResponseAllServicesFlag = 1;
-        timedResponseServiceIndex = 0;
-    } else {
-        timedResponseAllServicesFlag = 0;
+    TimedResponseSession * s;
+    
+    if (serviceIndex != SERVICE_ID_ALL) {
         if ((serviceIndex < 1) || (serviceIndex > NUM_SERVICES)) {
             // if we don't have the requested service then don't do anything
-            timedResponseType = TIMED_RESPONSE_NONE;
             return;
         }
-        timedResponseServiceIndex = (uint8_t)serviceIndex-1;
     }
-    timedResponseStep = 0;
-    timedResponseCallback = callback;
+    s = allocateSession(type, serviceIndex, callback);
+    s->type = type;
+    if (serviceIndex == SERVICE_ID_ALL) { 
+        // go through all the services
+        s->allServicesFlag = 1;
+        s->serviceIndex = 0;
+    } else {
+        s->allServicesFlag = 0;
+        s->serviceIndex = (uint8_t)serviceIndex-1;
+    }
+    s->step = 0;
+    s->startOrder = timedResponseStartCount++;
+    s->callback = callback;
 }
 
 /**
  * Call regularly to call the user's callback function. Handles the call back 
  * function's results to increment the step value and cycle through the services.
+ * Each call performs one step of the next session which is in progress.
+ * @return 1 if a step was performed, 0 if no timedResponse is in progress
  */
-void pollTimedResponse() {
+uint8_t pollTimedResponse(void) {
     TimedResponseResult result;
+    TimedResponseSession * s;
+    uint8_t i;
     
-    if (timedResponseType == TIMED_RESPONSE_NONE) {
+    // find the next session in progress
+    for (i=0; i<NUM_TIMED_RESPONSE_SESSIONS; i++) {
+        s = &(timedResponseSessions[timedResponseNextSession]);
+        timedResponseNextSession++;
+        if (timedResponseNextSession >= NUM_TIMED_RESPONSE_SESSIONS) {
+            timedResponseNextSession = 0;
+        }
+        if (s->type != TIMED_RESPONSE_NONE) {
+            break;
+        }
+    }
+    if (s->type == TIMED_RESPONSE_NONE) {
         // no timed responses in progress
-        return;
+        return 0;
     }
-    if (timedResponseCallback == NULL) {
+    if (s->callback == NULL) {
         // no callback defined so finish
-        timedResponseType = TIMED_RESPONSE_NONE;
-        return;
+        s->type = TIMED_RESPONSE_NONE;
+        return 1;
     }
 
-    // Now call the callback function
-    result = (*timedResponseCallback)(timedResponseType, timedResponseServiceIndex, timedResponseStep);
+    // Now call the callback function, repeating whilst it skips steps
+    for (i=0; ; i++) {
+        currentSession = s;
+        result = (*(s->callback))(s->type, s->serviceIndex, s->step);
+        currentSession = NULL;
+        if (result != TIMED_RESPONSE_RESULT_SKIP) {
+            break;
+        }
+        s->step++;
+        if (i == 0xFF) {
+            // don't hog the processor, carry on next time
+            return 1;
+        }
+    }
     switch (result) {
         case TIMED_RESPONSE_RESULT_FINISHED:
             // the callback tells us it has finished but lets check if there are other
             // services still to do
-            if (timedResponseAllServicesFlag) {
+            if (s->allServicesFlag) {
                 // move on to next service
-                timedResponseServiceIndex++;
-                if (timedResponseServiceIndex >= NUM_SERVICES) {
+                s->serviceIndex++;
+                if (s->serviceIndex >= NUM_SERVICES) {
                     // finished all the services
-                    timedResponseType = TIMED_RESPONSE_NONE;
+                    s->type = TIMED_RESPONSE_NONE;
                 } else {
-                    timedResponseStep = 0;
+                    s->step = 0;
                 }
             } else {
-                timedResponseType = TIMED_RESPONSE_NONE;
+                s->type = TIMED_RESPONSE_NONE;
             }
             break;
         case TIMED_RESPONSE_RESULT_RETRY:
             break;
         case TIMED_RESPONSE_RESULT_NEXT:
-            timedResponseStep++;
+            s->step++;
             break;
     }
+    return 1;
+}
+
+/**
+ * Find whether a timedResponse is in progress.
+ * @param type the type of timedResponse or TIMED_RESPONSE_NONE for any type
+ * @return TRUE if one is in progress
+ */
+Boolean timedResponseActive(uint8_t type) {
+    uint8_t i;
+    
+    for (i=0; i<NUM_TIMED_RESPONSE_SESSIONS; i++) {
+        if (timedResponseSessions[i].type == TIMED_RESPONSE_NONE) continue;
+        if ((type == TIMED_RESPONSE_NONE) || (timedResponseSessions[i].type == type)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+ * Set the step of the timedResponse whose callback is currently running. 
+ * Allows a callback to jump over steps for which there is nothing to send.
+ * Has no effect unless called from within a callback.
+ * @param step the new step value
+ */
+void seekTimedResponse(uint8_t step) {
+    if (currentSession != NULL) {
+        currentSession->step = step;
+    }
 }
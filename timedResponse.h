@@ -45,16 +45,36 @@
  * startTimedResponse() is to be called to start the transmission. A callback
  * function is provided and that function is called with an incrementing step 
  * value. The function must return a result to indicate that it has finished or 
- * that it still has more work to do.
+ * that it still has more work to do. A callback which had nothing to send for
+ * a step may return TIMED_RESPONSE_RESULT_SKIP so that the next step is done
+ * straight away rather than waiting for the next poll. A callback can also 
+ * jump directly to a later step using seekTimedResponse() so that sparse 
+ * tables are listed in time proportional to the number of entries present.
  * 
- * Only one set of timedResponse can be running at a time. If a second 
- * timedResponse is started then the first will be abandoned and replaced
- * by the new one.
+ * Up to NUM_TIMED_RESPONSE_SESSIONS sets of timedResponse can be running at 
+ * the same time and are serviced round-robin. Starting a timedResponse with the
+ * same type, service and callback as a running one restarts it. If all the 
+ * sessions are in use then the oldest is abandoned and replaced by the new one.
+ * 
+ * # Module.h definitions
+ * - #define NUM_TIMED_RESPONSE_SESSIONS  Optional. The number of timedResponse
+ *                      sets which can be in progress at once. Defaults to 3.
+ * - #define TIMED_RESPONSE_INTERVAL  Optional. The tick interval between bursts
+ *                      of steps. Defaults to TEN_MILI_SECOND.
+ * - #define TIMED_RESPONSE_MAX_STEPS Optional. The maximum number of steps in 
+ *                      each interval, limiting the share of the bus used. 
+ *                      Defaults to 2.
+ * - #define TIMED_RESPONSE_TX_RESERVE Optional. Steps are not performed whilst
+ *                      the transport has this many or fewer free transmit 
+ *                      buffers. Defaults to 0.
  * 
  * Call initTimedResponse() before other TimedResponse processing. 
- * This will set the current response set to be None.
+ * This will set all the response sets to be None.
  * Call pollTimedResponse() on a regular basis which will do the work needed for 
- * the next step and increments the step counter.
+ * the next step and increments the step counter. The MERGLCB poll() calls it 
+ * up to TIMED_RESPONSE_MAX_STEPS times each TIMED_RESPONSE_INTERVAL whilst the
+ * transport's sendSpace() reports free transmit buffers, so responses go out
+ * quickly on a quiet bus and back off when the transmit buffers fill.
  * 
  * To start send a set of timed responses call startTimedResponse specifying
  * the callback.
@@ -76,13 +96,16 @@ extern "C" {
 #define TIMED_RESPONSE_RDGN 4
 #define TIMED_RESPONSE_REQEV 5
 #define TIMED_RESPONSE_NVRD 6
+#define TIMED_RESPONSE_NVRDB 7
+#define TIMED_RESPONSE_NVDSC 8
 #define TIMED_RESPONSE_NONE 0xFF // must be an invalid tableIndex so same as NO_INDEX
     
 // The different APP callback responses
 typedef enum {
     TIMED_RESPONSE_RESULT_FINISHED, // done everything - no need to call back again
     TIMED_RESPONSE_RESULT_RETRY,    // something went wrong, call back again later
-    TIMED_RESPONSE_RESULT_NEXT      // not yet finished, call back again with next step
+    TIMED_RESPONSE_RESULT_NEXT,     // not yet finished, call back again with next step
+    TIMED_RESPONSE_RESULT_SKIP      // nothing sent, call back again immediately with next step
 } TimedResponseResult;
 
 /**
@@ -108,8 +131,23 @@ extern void startTimedResponse(uint8_t type, uint8_t serviceIndex, TimedResponse
 /*
  * Call regularly to call the user's callback function. Handles the call back 
  * function's results to increment the step value and cycle through the services.
+ * Returns 1 if a step was performed, 0 if there is nothing in progress.
+ */
+extern uint8_t pollTimedResponse(void);
+
+/*
+ * Set the step of the timedResponse whose callback is currently running. Only
+ * to be called from within a callback. The result returned by the callback is
+ * then applied to this step so returning TIMED_RESPONSE_RESULT_NEXT continues
+ * with the step after it.
+ */
+extern void seekTimedResponse(uint8_t step);
+
+/*
+ * Find whether a timedResponse of the type, or of any type if 
+ * TIMED_RESPONSE_NONE, is in progress.
  */
-extern void pollTimedResponse(void);
+extern Boolean timedResponseActive(uint8_t type);
 
 #ifdef	__cplusplus
 }
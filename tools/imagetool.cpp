@@ -0,0 +1,407 @@
+/**
+ * @copyright Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+ */
+/*
+  This work is licensed under the:
+      Creative Commons Attribution-NonCommercial-ShareAlike 4.0 International License.
+   To view a copy of this license, visit:
+      http://creativecommons.org/licenses/by-nc-sa/4.0/
+   or send a letter to Creative Commons, PO Box 1866, Mountain View, CA 94042, USA.
+
+   License summary:
+    You are free to:
+      Share, copy and redistribute the material in any medium or format
+      Adapt, remix, transform, and build upon the material
+
+    The licensor cannot revoke these freedoms as long as you follow the license terms.
+
+    Attribution : You must give appropriate credit, provide a link to the license,
+                   and indicate if changes were made. You may do so in any reasonable manner,
+                   but not in any way that suggests the licensor endorses you or your use.
+
+    NonCommercial : You may not use the material for commercial purposes. **(see note below)
+
+    ShareAlike : If you remix, transform, or build upon the material, you must distribute
+                  your contributions under the same license as the original.
+
+    No additional restrictions : You may not apply legal terms or technological measures that
+                                  legally restrict others from doing anything the license permits.
+
+   ** For commercial use, please contact the original copyright holder(s) to agree licensing terms
+
+    This software is distributed in the hope that it will be useful, but WITHOUT ANY
+    WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE
+ */
+/**
+ * @file
+ * Host tool to show, compare and merge module configuration images.
+ * @details
+ * Works on the images produced by readImage() as described in image.h: a 16 
+ * byte header, the event table rows as stored in NVM and then the NVs.
+ * <pre>
+ * imagetool info IMAGE              list the header, events and NVs
+ * imagetool diff IMAGE_A IMAGE_B    list the differences, exit status 1 if any
+ * imagetool merge BASE OTHER OUT [--nvs-from-other]
+ *                                   events from both images, OTHER taking 
+ *                                   priority for events in both, NVs from BASE
+ * </pre>
+ * The merged table is written with each event's rows contiguous, as after 
+ * defragEventTable(), and a new CRC.
+ * 
+ * Importing an image into a module writes over the module's configuration as
+ * the image arrives, and a failed import leaves the module at its factory 
+ * defaults. Have the module check the image with beginImageCheck() first.
+ * 
+ * Build with: g++ -std=c++11 -o imagetool imagetool.cpp
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace {
+
+// as in image.h
+const size_t IMAGE_HEADER_SIZE = 16;
+const size_t IMAGE_OFFSET_FORMAT = 2;
+const size_t IMAGE_OFFSET_NVM_VERSION = 3;
+const size_t IMAGE_OFFSET_MANU = 4;
+const size_t IMAGE_OFFSET_MODULE_ID = 5;
+const size_t IMAGE_OFFSET_NUM_EVENTS = 6;
+const size_t IMAGE_OFFSET_ROW_WIDTH = 7;
+const size_t IMAGE_OFFSET_TABLE_WIDTH = 8;
+const size_t IMAGE_OFFSET_NUM_EVS = 9;
+const size_t IMAGE_OFFSET_NUM_NVS = 10;
+const size_t IMAGE_OFFSET_LAYOUT = 11;
+const size_t IMAGE_OFFSET_LENGTH = 12;
+const size_t IMAGE_OFFSET_CRC = 14;
+const uint8_t IMAGE_LAYOUT_COMPACT = 0x01;
+
+// as in event_teach.h
+const size_t EVENTTABLE_OFFSET_FLAGS = 0;
+const size_t EVENTTABLE_OFFSET_NEXT = 1;
+const size_t EVENTTABLE_OFFSET_NN = 2;
+const size_t EVENTTABLE_OFFSET_EN = 4;
+const size_t EVENTTABLE_OFFSET_EVS = 6;
+const uint8_t FLAG_EVS_USED = 0x0F;
+const uint8_t FLAG_CONTINUED = 0x10;
+const uint8_t FLAG_CONTINUATION = 0x20;
+const uint8_t FLAG_FORCE_OWN_NN = 0x40;
+const uint8_t FLAG_FREE = 0x80;
+const uint8_t EV_FILL = 0xFF;
+const uint8_t NO_INDEX = 0xFF;
+
+struct Event {
+    bool forceOwnNN;
+    std::vector<uint8_t> evs;
+};
+
+// events keyed by NN<<16|EN so that they are listed in order
+typedef std::map<uint32_t, Event> EventMap;
+
+uint16_t crcByte(uint16_t crc, uint8_t value) {
+    crc ^= (uint16_t)(value << 8);
+    for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+class Image {
+public:
+    explicit Image(const std::string & filename) {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        if ( ! in) throw std::runtime_error("can't open " + filename);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if ((bytes.size() < IMAGE_HEADER_SIZE) || (bytes[0] != 'L') || (bytes[1] != 'I')) {
+            throw std::runtime_error(filename + " is not an image");
+        }
+        if (bytes.size() != IMAGE_HEADER_SIZE + bodyLength()) {
+            throw std::runtime_error(filename + " has the wrong length");
+        }
+        numEvents = bytes[IMAGE_OFFSET_NUM_EVENTS];
+        rowWidth = bytes[IMAGE_OFFSET_ROW_WIDTH];
+        tableWidth = bytes[IMAGE_OFFSET_TABLE_WIDTH];
+        if (bytes[IMAGE_OFFSET_LAYOUT] & ~IMAGE_LAYOUT_COMPACT) {
+            throw std::runtime_error(filename + " has an unknown layout");
+        }
+        compactLayout = (bytes[IMAGE_OFFSET_LAYOUT] & IMAGE_LAYOUT_COMPACT) != 0;
+        moreOffset = compactLayout ? EVENTTABLE_OFFSET_NN : EVENTTABLE_OFFSET_EVS;
+        moreWidth = compactLayout ? tableWidth + 4 : tableWidth;
+        // the normal layout always has 16 byte rows
+        if ((rowWidth != (compactLayout ? EVENTTABLE_OFFSET_EVS + tableWidth : 16))
+                || (rowWidth < EVENTTABLE_OFFSET_EVS + tableWidth) 
+                || ((size_t)numEvents*rowWidth + bytes[IMAGE_OFFSET_NUM_NVS] != bodyLength())) {
+            throw std::runtime_error(filename + " has an inconsistent geometry");
+        }
+    }
+    
+    size_t bodyLength() const {
+        return bytes[IMAGE_OFFSET_LENGTH] | (bytes[IMAGE_OFFSET_LENGTH+1] << 8);
+    }
+    
+    uint16_t storedCrc() const {
+        return (uint16_t)(bytes[IMAGE_OFFSET_CRC] | (bytes[IMAGE_OFFSET_CRC+1] << 8));
+    }
+    
+    uint16_t calculateCrc() const {
+        uint16_t crc = 0xFFFF;
+        for (size_t i = IMAGE_HEADER_SIZE; i < bytes.size(); i++) {
+            crc = crcByte(crc, bytes[i]);
+        }
+        return crc;
+    }
+    
+    bool sameModule(const Image & other) const {
+        return std::memcmp(&bytes[0], &other.bytes[0], IMAGE_OFFSET_CRC) == 0;
+    }
+    
+    uint8_t nv(size_t index) const {
+        return bytes[IMAGE_HEADER_SIZE + (size_t)numEvents*rowWidth + index - 1];
+    }
+    
+    size_t numNvs() const {
+        return bytes[IMAGE_OFFSET_NUM_NVS];
+    }
+    
+    const uint8_t * row(size_t index) const {
+        return &bytes[IMAGE_HEADER_SIZE + index*rowWidth];
+    }
+    
+    /**
+     * Decode the event table, following each event's chain of rows as getEv()
+     * does.
+     */
+    EventMap events() const {
+        EventMap result;
+        for (size_t i = 0; i < numEvents; i++) {
+            const uint8_t * r = row(i);
+            uint8_t flags = r[EVENTTABLE_OFFSET_FLAGS];
+            if ((flags & FLAG_FREE) || (flags & FLAG_CONTINUATION)) continue;
+            Event event;
+            event.forceOwnNN = (flags & FLAG_FORCE_OWN_NN) != 0;
+            size_t offset = EVENTTABLE_OFFSET_EVS;
+            size_t width = tableWidth;
+            size_t hops = 0;
+            while (true) {
+                size_t used = (flags & FLAG_CONTINUED) ? width : (flags & FLAG_EVS_USED);
+                for (size_t e = 0; (e < used) && (e < width); e++) {
+                    event.evs.push_back(r[offset + e]);
+                }
+                if ( ! (flags & FLAG_CONTINUED)) break;
+                uint8_t next = r[EVENTTABLE_OFFSET_NEXT];
+                if ((next == NO_INDEX) || (next >= numEvents) || (++hops >= numEvents)) {
+                    std::fprintf(stderr, "warning: broken chain at row %u\n", (unsigned)i);
+                    break;
+                }
+                r = row(next);
+                flags = r[EVENTTABLE_OFFSET_FLAGS];
+                offset = moreOffset;
+                width = moreWidth;
+            }
+            uint32_t key = ((uint32_t)(row(i)[EVENTTABLE_OFFSET_NN] | (row(i)[EVENTTABLE_OFFSET_NN+1] << 8)) << 16)
+                    | (uint32_t)(row(i)[EVENTTABLE_OFFSET_EN] | (row(i)[EVENTTABLE_OFFSET_EN+1] << 8));
+            result[key] = event;
+        }
+        return result;
+    }
+    
+    /**
+     * Replace the event table, writing each event's rows contiguously.
+     */
+    void setEvents(const EventMap & events) {
+        std::vector<uint8_t> table((size_t)numEvents*rowWidth, 0xFF);
+        size_t index = 0;
+        for (EventMap::const_iterator it = events.begin(); it != events.end(); ++it) {
+            const std::vector<uint8_t> & evs = it->second.evs;
+            size_t rows = 1;
+            if (evs.size() > tableWidth) {
+                rows += (evs.size() - tableWidth + moreWidth - 1) / moreWidth;
+            }
+            if (index + rows > numEvents) {
+                throw std::runtime_error("the events don't fit in the event table");
+            }
+            size_t ev = 0;
+            for (size_t n = 0; n < rows; n++) {
+                uint8_t * r = &table[(index + n)*rowWidth];
+                size_t offset = n ? moreOffset : EVENTTABLE_OFFSET_EVS;
+                size_t width = n ? moreWidth : tableWidth;
+                uint8_t flags = n ? FLAG_CONTINUATION : (it->second.forceOwnNN ? FLAG_FORCE_OWN_NN : 0);
+                if (n == 0) {
+                    r[EVENTTABLE_OFFSET_NN] = (uint8_t)(it->first >> 16);
+                    r[EVENTTABLE_OFFSET_NN+1] = (uint8_t)(it->first >> 24);
+                    r[EVENTTABLE_OFFSET_EN] = (uint8_t)it->first;
+                    r[EVENTTABLE_OFFSET_EN+1] = (uint8_t)(it->first >> 8);
+                }
+                size_t used;
+                for (used = 0; (used < width) && (ev < evs.size()); used++) {
+                    r[offset + used] = evs[ev++];
+                }
+                if (n + 1 < rows) {
+                    flags |= FLAG_CONTINUED;
+                    r[EVENTTABLE_OFFSET_NEXT] = (uint8_t)(index + n + 1);
+                }
+                // getEv() checks the count in every row
+                r[EVENTTABLE_OFFSET_FLAGS] = flags | (uint8_t)used;
+            }
+            index += rows;
+        }
+        std::copy(table.begin(), table.end(), bytes.begin() + IMAGE_HEADER_SIZE);
+    }
+    
+    void copyNvs(const Image & other) {
+        std::copy(other.bytes.end() - numNvs(), other.bytes.end(), bytes.end() - numNvs());
+    }
+    
+    void save(const std::string & filename) {
+        uint16_t crc = calculateCrc();
+        bytes[IMAGE_OFFSET_CRC] = (uint8_t)crc;
+        bytes[IMAGE_OFFSET_CRC+1] = (uint8_t)(crc >> 8);
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out.write((const char *)&bytes[0], (std::streamsize)bytes.size());
+        if ( ! out) throw std::runtime_error("can't write " + filename);
+    }
+    
+    std::vector<uint8_t> bytes;
+    size_t numEvents;
+    size_t rowWidth;
+    size_t tableWidth;
+    bool compactLayout;
+    size_t moreOffset;
+    size_t moreWidth;
+};
+
+std::string eventName(uint32_t key) {
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%u:%u", (unsigned)(key >> 16), (unsigned)(key & 0xFFFF));
+    return buf;
+}
+
+std::string evList(const Event & event) {
+    std::string s;
+    char buf[8];
+    for (size_t i = 0; i < event.evs.size(); i++) {
+        std::snprintf(buf, sizeof(buf), " %u", (unsigned)event.evs[i]);
+        s += buf;
+    }
+    return event.forceOwnNN ? s + " (own NN)" : s;
+}
+
+bool sameEvent(const Event & a, const Event & b) {
+    return (a.forceOwnNN == b.forceOwnNN) && (a.evs == b.evs);
+}
+
+int info(const Image & image) {
+    const std::vector<uint8_t> & b = image.bytes;
+    std::printf("format %u, NVM version %u, manufacturer %u, module id %u\n",
+            b[IMAGE_OFFSET_FORMAT], b[IMAGE_OFFSET_NVM_VERSION], b[IMAGE_OFFSET_MANU], b[IMAGE_OFFSET_MODULE_ID]);
+    std::printf("%u rows of %u bytes, %u EVs per row, %u EVs per event, %u NVs%s\n",
+            (unsigned)image.numEvents, (unsigned)image.rowWidth, (unsigned)image.tableWidth, 
+            b[IMAGE_OFFSET_NUM_EVS], (unsigned)image.numNvs(), image.compactLayout ? ", compact layout" : "");
+    std::printf("CRC %04X %s\n", image.storedCrc(), (image.storedCrc() == image.calculateCrc()) ? "ok" : "WRONG");
+    EventMap events = image.events();
+    std::printf("%u events\n", (unsigned)events.size());
+    for (EventMap::const_iterator it = events.begin(); it != events.end(); ++it) {
+        std::printf("  %s%s\n", eventName(it->first).c_str(), evList(it->second).c_str());
+    }
+    for (size_t i = 1; i <= image.numNvs(); i++) {
+        std::printf("NV%u %u\n", (unsigned)i, image.nv(i));
+    }
+    return 0;
+}
+
+int diff(const Image & a, const Image & b) {
+    int differences = 0;
+    if ( ! a.sameModule(b)) {
+        std::printf("the images are from different module types or geometries\n");
+        return 2;
+    }
+    EventMap ea = a.events();
+    EventMap eb = b.events();
+    for (EventMap::const_iterator it = ea.begin(); it != ea.end(); ++it) {
+        EventMap::const_iterator other = eb.find(it->first);
+        if (other == eb.end()) {
+            std::printf("- %s%s\n", eventName(it->first).c_str(), evList(it->second).c_str());
+            differences++;
+        } else if ( ! sameEvent(it->second, other->second)) {
+            std::printf("< %s%s\n", eventName(it->first).c_str(), evList(it->second).c_str());
+            std::printf("> %s%s\n", eventName(it->first).c_str(), evList(other->second).c_str());
+            differences++;
+        }
+    }
+    for (EventMap::const_iterator it = eb.begin(); it != eb.end(); ++it) {
+        if (ea.find(it->first) == ea.end()) {
+            std::printf("+ %s%s\n", eventName(it->first).c_str(), evList(it->second).c_str());
+            differences++;
+        }
+    }
+    for (size_t i = 1; i <= a.numNvs(); i++) {
+        if (a.nv(i) != b.nv(i)) {
+            std::printf("NV%u %u -> %u\n", (unsigned)i, a.nv(i), b.nv(i));
+            differences++;
+        }
+    }
+    return differences ? 1 : 0;
+}
+
+int merge(Image & base, const Image & other, const std::string & out, bool nvsFromOther) {
+    if ( ! base.sameModule(other)) {
+        std::fprintf(stderr, "the images are from different module types or geometries\n");
+        return 2;
+    }
+    EventMap events = base.events();
+    EventMap otherEvents = other.events();
+    for (EventMap::const_iterator it = otherEvents.begin(); it != otherEvents.end(); ++it) {
+        EventMap::iterator existing = events.find(it->first);
+        if ((existing != events.end()) && ! sameEvent(existing->second, it->second)) {
+            std::fprintf(stderr, "using %s from the second image\n", eventName(it->first).c_str());
+        }
+        events[it->first] = it->second;
+    }
+    base.setEvents(events);
+    if (nvsFromOther) {
+        base.copyNvs(other);
+    }
+    base.save(out);
+    return 0;
+}
+
+int usage() {
+    std::fprintf(stderr, "usage: imagetool info IMAGE\n"
+            "       imagetool diff IMAGE_A IMAGE_B\n"
+            "       imagetool merge BASE OTHER OUT [--nvs-from-other]\n"
+            "note: a module writes an imported image over its configuration as it\n"
+            "      arrives and a failed import leaves it at factory defaults, so have\n"
+            "      the module check the image (beginImageCheck) before importing it\n");
+    return 2;
+}
+
+}
+
+int main(int argc, char ** argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    try {
+        if ((args.size() == 2) && (args[0] == "info")) {
+            return info(Image(args[1]));
+        }
+        if ((args.size() == 3) && (args[0] == "diff")) {
+            return diff(Image(args[1]), Image(args[2]));
+        }
+        if (((args.size() == 4) || (args.size() == 5)) && (args[0] == "merge")) {
+            bool nvsFromOther = (args.size() == 5);
+            if (nvsFromOther && (args[4] != "--nvs-from-other")) return usage();
+            Image base(args[1]);
+            return merge(base, Image(args[2]), args[3], nvsFromOther);
+        }
+    } catch (const std::exception & e) {
+        std::fprintf(stderr, "imagetool: %s\n", e.what());
+        return 2;
+    }
+    return usage();
+}